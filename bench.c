@@ -0,0 +1,509 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Headless benchmark of the player: opens, seeks, audio switches and pauses
+ * a file many times with fake sinks and prints the latency distributions as
+ * one JSON object per line. With --sort it times the browser's sort instead.
+ */
+
+#include "eplay.h"
+
+#include <Ecore.h>
+
+#include <getopt.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_TIMEOUT 10.0 /* s to wait for any single step */
+#define BENCH_MEDIA_SECONDS 60
+#define BENCH_SORT_NAMES 100000
+#define BENCH_SORT_DIR "/media/usb0/Videos/Recordings"
+
+struct samples
+{
+    const char* name;
+    double* values; /* ms */
+    unsigned int count, size;
+};
+
+static struct eplay g_bench;
+
+// written by the audio sink's streaming thread
+static uint64_t s_switch_start;
+static uint64_t s_switch_latency;
+static unsigned int s_switches;
+static int s_channels;
+
+/* the parts of the gui and the display the player calls into */
+
+const char* eplay_next_file(struct eplay* ep, const char* file)
+{
+    return NULL; // every open is cold
+}
+
+void eplay_metadata_updated(struct eplay* ep, const char* path)
+{
+}
+
+bool eplay_show_overlay(struct eplay* ep)
+{
+    return true;
+}
+
+GstElement* eplay_create_video_sink(struct eplay* ep, bool background)
+{
+    return NULL;
+}
+
+void eplay_video_sink_show(GstElement* sink)
+{
+}
+
+void eplay_cleanup_video(struct eplay* ep)
+{
+}
+
+static void add_sample(struct samples* s, uint64_t us)
+{
+    if (s->count == s->size)
+    {
+        unsigned int size = s->size ? s->size * 2 : 64;
+        double* v = realloc(s->values, size * sizeof(*v));
+        if (!v)
+            return;
+        s->values = v;
+        s->size = size;
+    }
+    s->values[s->count++] = us / 1000.0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const struct samples* s, unsigned int p)
+{
+    return s->values[(s->count - 1) * p / 100];
+}
+
+static void print_samples(FILE* out, struct samples* s)
+{
+    double sum = 0.0;
+    unsigned int i;
+
+    if (!s->count)
+    {
+        fprintf(out, "{\"metric\":\"%s\",\"unit\":\"ms\",\"count\":0}\n", s->name);
+        return;
+    }
+
+    qsort(s->values, s->count, sizeof(*s->values), compare_double);
+    for (i = 0; i < s->count; ++i)
+        sum += s->values[i];
+
+    fprintf(out, "{\"metric\":\"%s\",\"unit\":\"ms\",\"count\":%u,\"min\":%.3f,\"mean\":%.3f,"
+            "\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f,\"samples\":[",
+            s->name, s->count, s->values[0], sum / s->count, percentile(s, 50),
+            percentile(s, 90), percentile(s, 99), s->values[s->count - 1]);
+    for (i = 0; i < s->count; ++i)
+        fprintf(out, "%s%.3f", i ? "," : "", s->values[i]);
+    fprintf(out, "]}\n");
+}
+
+// runs the main loop until the counter reaches target
+static bool wait_for(const unsigned int* counter, unsigned int target, double timeout)
+{
+    double end = ecore_time_get() + timeout;
+
+    while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) < target)
+    {
+        if (ecore_time_get() > end)
+            return false;
+        ecore_main_loop_iterate();
+        usleep(500);
+    }
+    return true;
+}
+
+static void run_for(double seconds)
+{
+    double end = ecore_time_get() + seconds;
+
+    while (ecore_time_get() < end)
+    {
+        ecore_main_loop_iterate();
+        usleep(1000);
+    }
+}
+
+// streaming thread: the audio tracks of the test media differ in channel count
+static void audio_handoff(GstElement* sink, GstBuffer* buffer, GstPad* pad, gpointer data)
+{
+    GstCaps* caps = GST_BUFFER_CAPS(buffer);
+    uint64_t start = __atomic_load_n(&s_switch_start, __ATOMIC_ACQUIRE);
+    gint channels = 0;
+
+    if (!caps || !gst_structure_get_int(gst_caps_get_structure(caps, 0), "channels", &channels))
+        return;
+
+    if (start && channels != __atomic_load_n(&s_channels, __ATOMIC_RELAXED))
+    {
+        s_switch_latency = eplay_time_us() - start;
+        __atomic_store_n(&s_switch_start, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&s_switches, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&s_channels, channels, __ATOMIC_RELAXED);
+}
+
+// video and two audio tracks with one and two channels
+static bool generate_media(const char* path)
+{
+    GstElement* pipeline;
+    GstMessage* msg;
+    GstBus* bus;
+    GError* err = NULL;
+    gchar* desc;
+    bool ok;
+
+    desc = g_strdup_printf(
+        "matroskamux name=mux ! filesink location=\"%s\" "
+        "videotestsrc num-buffers=%i ! video/x-raw-yuv,width=640,height=360,framerate=25/1 ! jpegenc ! queue ! mux. "
+        "audiotestsrc num-buffers=%i samplesperbuffer=1200 freq=440 ! audio/x-raw-int,rate=48000,channels=1 ! queue ! mux. "
+        "audiotestsrc num-buffers=%i samplesperbuffer=1200 freq=880 ! audio/x-raw-int,rate=48000,channels=2 ! queue ! mux.",
+        path, BENCH_MEDIA_SECONDS * 25, BENCH_MEDIA_SECONDS * 40, BENCH_MEDIA_SECONDS * 40);
+    pipeline = gst_parse_launch(desc, &err);
+    g_free(desc);
+    if (!pipeline)
+    {
+        fprintf(stderr, "bench: cannot generate test media: %s\n", err ? err->message : "?");
+        if (err)
+            g_error_free(err);
+        return false;
+    }
+
+    fprintf(stderr, "bench: generating '%s'\n", path);
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    bus = gst_element_get_bus(pipeline);
+    msg = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    ok = msg && GST_MESSAGE_TYPE(msg) == GST_MESSAGE_EOS;
+    if (msg)
+        gst_message_unref(msg);
+    gst_object_unref(bus);
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+
+    if (!ok)
+    {
+        fprintf(stderr, "bench: generating '%s' failed\n", path);
+        unlink(path);
+    }
+    return ok;
+}
+
+static int compare_coll(const void* a, const void* b)
+{
+    return strcoll(a, b);
+}
+
+static int compare_coll_ptr(const void* a, const void* b)
+{
+    return strcoll(*(const char* const*)a, *(const char* const*)b);
+}
+
+// names like a recorder or a download folder produces them, in no particular order
+static const char** sort_names(unsigned int count)
+{
+    static const char* words[] = { "News", "Tatort", "Die Sendung mit der Maus", "Doctor Who",
+                                   "Ärzte", "Das Boot", "Episode", "Season", "Übersicht", "tagesschau" };
+    const char** names = malloc(count * sizeof(*names));
+    unsigned int seed = 1, i;
+    char buf[PATH_MAX];
+
+    if (!names)
+        return NULL;
+    for (i = 0; i < count; ++i)
+    {
+        unsigned int w = rand_r(&seed) % 10, e = rand_r(&seed) % 200;
+
+        snprintf(buf, sizeof(buf), "%s/%s %s %u - Part %u.ts", BENCH_SORT_DIR, words[w],
+                 words[(w + e) % 10], e, i);
+        names[i] = eina_stringshare_add(buf);
+    }
+    return names;
+}
+
+// the browser sorts before it shows a folder, timed against what it did before
+static void sort_bench(FILE* out, int runs, unsigned int count)
+{
+    struct samples list = { "sort_eina_list_strcoll" }, array = { "sort_qsort_strcoll" };
+    struct samples modes[] = { { "sort_natural" }, { "sort_collate" }, { "sort_bytes" } };
+    const char** names = sort_names(count);
+    const char** copy = malloc(count * sizeof(*copy));
+    unsigned int m, i;
+    int r;
+
+    if (!names || !copy)
+    {
+        fprintf(stderr, "bench: no memory for %u names\n", count);
+        free(names);
+        free(copy);
+        return;
+    }
+
+    fprintf(out, "{\"bench\":\"sort\",\"names\":%u,\"runs\":%i,\"locale\":\"%s\"}\n", count, runs,
+            setlocale(LC_COLLATE, NULL));
+    for (r = 0; r < runs; ++r)
+    {
+        Eina_List* l = NULL;
+        unsigned int* order;
+        uint64_t start;
+
+        for (i = 0; i < count; ++i)
+            l = eina_list_append(l, names[i]);
+        start = eplay_time_us();
+        l = eina_list_sort(l, 0, compare_coll);
+        add_sample(&list, eplay_time_us() - start);
+        eina_list_free(l);
+
+        memcpy(copy, names, count * sizeof(*copy));
+        start = eplay_time_us();
+        qsort(copy, count, sizeof(*copy), compare_coll_ptr);
+        add_sample(&array, eplay_time_us() - start);
+
+        for (m = 0; m < sizeof(modes) / sizeof(*modes); ++m)
+        {
+            start = eplay_time_us();
+            order = eplay_sort_order(names, count, strlen(BENCH_SORT_DIR) + 1, m);
+            add_sample(&modes[m], eplay_time_us() - start);
+            free(order);
+        }
+    }
+
+    print_samples(out, &list);
+    print_samples(out, &array);
+    for (m = 0; m < sizeof(modes) / sizeof(*modes); ++m)
+    {
+        print_samples(out, &modes[m]);
+        free(modes[m].values);
+    }
+    free(list.values);
+    free(array.values);
+
+    for (i = 0; i < count; ++i)
+        eina_stringshare_del(names[i]);
+    free(names);
+    free(copy);
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [options] [file]\n"
+        "  -n, --runs=N      number of runs (default 20)\n"
+        "  -o, --output=FILE write the results to FILE instead of stdout\n"
+        "  -v, --verbose     keep the player's log on stdout\n"
+        "  -s, --sort[=N]    time the browser sort of N names (default %i) instead of playback\n"
+        "without a file a %i s test clip is generated in $TMPDIR\n",
+        name, BENCH_SORT_NAMES, BENCH_MEDIA_SECONDS);
+}
+
+int main(int argc, char** argv)
+{
+    static const struct option options[] = {
+        { "runs", required_argument, NULL, 'n' },
+        { "output", required_argument, NULL, 'o' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "sort", optional_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct samples ttff = { "ttff" }, seek = { "seek" }, audio = { "audio_switch" };
+    struct samples pause = { "pause" }, resume = { "resume" };
+    struct eplay* ep = &g_bench;
+    const char* output = NULL;
+    char media[PATH_MAX];
+    GstElement* sink = NULL;
+    bool verbose = false;
+    int runs = 20, failed = 0, names = 0, i, c;
+    gint naudio = 0;
+    FILE* out;
+
+    while ((c = getopt_long(argc, argv, "n:o:vs::", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            runs = atoi(optarg);
+            if (runs < 1)
+            {
+                fprintf(stderr, "runs must be at least 1\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 's':
+            names = optarg ? atoi(optarg) : BENCH_SORT_NAMES;
+            if (names < 1)
+            {
+                fprintf(stderr, "names must be at least 1\n");
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (names)
+    {
+        out = output ? fopen(output, "w") : stdout;
+        if (!out)
+        {
+            perror("bench: output");
+            return 1;
+        }
+        // orders like the player does in the user's locale
+        setlocale(LC_ALL, "");
+        eina_init();
+        sort_bench(out, runs, names);
+        fclose(out);
+        eina_shutdown();
+        return 0;
+    }
+
+    ecore_init();
+    gst_init(&argc, &argv);
+
+    if (optind < argc)
+    {
+        snprintf(media, sizeof(media), "%s", argv[optind]);
+    }
+    else
+    {
+        snprintf(media, sizeof(media), "%s/eplay-bench.mkv", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+        if (access(media, R_OK) != 0 && !generate_media(media))
+            return 1;
+    }
+
+    out = output ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+    if (!out)
+    {
+        perror("bench: output");
+        return 1;
+    }
+    // the player logs every step on stdout, only the results go there
+    if (!verbose && !output && !freopen("/dev/null", "w", stdout))
+        return 1;
+
+    ep->headless = true;
+    if (!eplay_setup_readahead(ep) || !eplay_setup_gstreamer(ep))
+        return 1;
+
+    g_object_get(ep->playbin, "audio-sink", &sink, NULL);
+    if (sink)
+    {
+        g_signal_connect(sink, "handoff", G_CALLBACK(audio_handoff), NULL);
+        gst_object_unref(sink);
+    }
+
+    for (i = 0; i < runs; ++i)
+    {
+        unsigned int n = ep->ttff_stats[0].count;
+
+        eplay_play(ep, media);
+        if (!wait_for(&ep->ttff_stats[0].count, n + 1, BENCH_TIMEOUT))
+        {
+            fprintf(stderr, "bench: run %i: no first frame\n", i);
+            failed++;
+            continue;
+        }
+        add_sample(&ttff, ep->ttff_stats[0].last);
+        run_for(0.5);
+
+        // spread over the clip, the settle delay of eplay_seek is not counted
+        n = ep->play_stats[PLAY_SEEK].count;
+        eplay_seek(ep, 5 + i * 7 % (BENCH_MEDIA_SECONDS / 2));
+        if (wait_for(&ep->play_stats[PLAY_SEEK].count, n + 1, BENCH_TIMEOUT + EPLAY_SEEK_SETTLE))
+            add_sample(&seek, ep->play_stats[PLAY_SEEK].last);
+        else
+            failed++;
+        run_for(0.5);
+
+        g_object_get(ep->playbin, "n-audio", &naudio, NULL);
+        if (naudio > 1)
+        {
+            n = s_switches;
+            __atomic_store_n(&s_switch_start, eplay_time_us(), __ATOMIC_RELEASE);
+            eplay_switch_audio(ep);
+            if (wait_for(&s_switches, n + 1, BENCH_TIMEOUT))
+                add_sample(&audio, s_switch_latency);
+            else
+                failed++;
+        }
+
+        n = ep->play_stats[PLAY_PAUSE].count;
+        eplay_set_playing(ep, false);
+        if (wait_for(&ep->play_stats[PLAY_PAUSE].count, n + 1, BENCH_TIMEOUT))
+            add_sample(&pause, ep->play_stats[PLAY_PAUSE].last);
+        else
+            failed++;
+
+        n = ep->play_stats[PLAY_START].count;
+        eplay_set_playing(ep, true);
+        if (wait_for(&ep->play_stats[PLAY_START].count, n + 1, BENCH_TIMEOUT))
+            add_sample(&resume, ep->play_stats[PLAY_START].last);
+        else
+            failed++;
+    }
+
+    fprintf(out, "{\"bench\":\"eplay\",\"file\":\"%s\",\"runs\":%i,\"failed\":%i}\n", media, runs, failed);
+    print_samples(out, &ttff);
+    print_samples(out, &seek);
+    print_samples(out, &audio);
+    print_samples(out, &pause);
+    print_samples(out, &resume);
+    fclose(out);
+
+    eplay_cleanup_gstreamer(ep);
+    eplay_cleanup_readahead(ep);
+    ecore_shutdown();
+
+    free(ttff.values);
+    free(seek.values);
+    free(audio.values);
+    free(pause.values);
+    free(resume.values);
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Compares the vectorised OSD conversions with their scalar references on
+ * random rows, run by "make check".
+ */
+
+#include "eplay.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_MAX_WIDTH 67 /* covers every remainder of the 8 and 16 pixel loops */
+#define CHECK_ROWS 200    /* random rows per width */
+
+static const char* s_formats[] = { "argb8888", "argb4444", "argb1555", "rgb565" };
+
+// premultiplied like evas renders, with the corner cases mixed in
+static uint32_t random_pixel(unsigned int* seed)
+{
+    uint32_t a, p;
+
+    switch (rand_r(seed) % 8)
+    {
+    case 0:
+        return 0;
+    case 1:
+        return 0xFFFFFFFF;
+    case 2:
+        // opaque pixels that convert to the rgb565 colour key
+        return 0xFFF800F8 | (rand_r(seed) & 0x00070307);
+    default:
+        a = rand_r(seed) & 0xFF;
+        p = (uint32_t)rand_r(seed) ^ ((uint32_t)rand_r(seed) << 16);
+        return a << 24 | (((p >> 16 & 0xFF) * a / 255) << 16) | (((p >> 8 & 0xFF) * a / 255) << 8) |
+               ((p & 0xFF) * a / 255);
+    }
+}
+
+static bool check_format(const struct pixel_format* fmt, unsigned int* seed)
+{
+    // one spare pixel in front to test unaligned rows, one behind to catch overruns
+    uint32_t src[CHECK_MAX_WIDTH + 1];
+    uint8_t dst[(CHECK_MAX_WIDTH + 2) * 4], ref[(CHECK_MAX_WIDTH + 2) * 4];
+    int w, r, i;
+
+    for (w = 1; w <= CHECK_MAX_WIDTH; ++w)
+    {
+        for (r = 0; r < CHECK_ROWS; ++r)
+        {
+            int shift = r & 1;
+
+            for (i = 0; i < w + 1; ++i)
+                src[i] = random_pixel(seed);
+            memset(dst, 0xA5, sizeof(dst));
+            memset(ref, 0xA5, sizeof(ref));
+
+            fmt->convert_row(dst + shift * fmt->cpp, src + shift, w);
+            fmt->convert_row_ref(ref + shift * fmt->cpp, src + shift, w);
+
+            if (memcmp(dst, ref, sizeof(dst)) != 0)
+            {
+                for (i = 0; i < (int)sizeof(dst) && dst[i] == ref[i]; ++i)
+                    ;
+                fprintf(stderr, "%s: width %i%s differs at byte %i: 0x%02x, expected 0x%02x\n",
+                        fmt->name, w, shift ? " unaligned" : "", i - shift * fmt->cpp, dst[i], ref[i]);
+                return false;
+            }
+        }
+    }
+    printf("%s: %i widths, %i rows each, ok\n", fmt->name, CHECK_MAX_WIDTH, CHECK_ROWS);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+    unsigned int i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(s_formats) / sizeof(*s_formats); ++i)
+    {
+        const struct pixel_format* fmt = eplay_pixel_format_find(s_formats[i]);
+
+        if (!fmt)
+        {
+            fprintf(stderr, "%s: not found\n", s_formats[i]);
+            failed++;
+        }
+        else if (!check_format(fmt, &seed))
+        {
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
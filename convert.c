@@ -0,0 +1,276 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <drm_fourcc.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Evas renders premultiplied ARGB32, the conversions below truncate each
+ * channel. RGB565 has no alpha, pixels below half coverage become the
+ * colour key and opaque pixels that happen to match the key get nudged.
+ */
+
+#define RGB565_KEY 0xF81F
+
+static inline uint16_t
+to_argb4444(uint32_t p)
+{
+    return ((p >> 16) & 0xF000) | ((p >> 12) & 0x0F00) | ((p >> 8) & 0x00F0) | ((p >> 4) & 0x000F);
+}
+
+static inline uint16_t
+to_argb1555(uint32_t p)
+{
+    return ((p >> 16) & 0x8000) | ((p >> 9) & 0x7C00) | ((p >> 6) & 0x03E0) | ((p >> 3) & 0x001F);
+}
+
+static inline uint16_t
+to_rgb565(uint32_t p)
+{
+    uint16_t v = ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F);
+    if (v == RGB565_KEY)
+        v ^= 1;
+    return (p & 0x80000000) ? v : RGB565_KEY;
+}
+
+static void
+row_argb8888_c(void* dst, const uint32_t* src, int w)
+{
+    memcpy(dst, src, w * 4);
+}
+
+static void
+row_argb4444_c(void* dst, const uint32_t* src, int w)
+{
+    uint16_t* d = dst;
+    int i;
+    for (i = 0; i < w; ++i)
+        d[i] = to_argb4444(src[i]);
+}
+
+static void
+row_argb1555_c(void* dst, const uint32_t* src, int w)
+{
+    uint16_t* d = dst;
+    int i;
+    for (i = 0; i < w; ++i)
+        d[i] = to_argb1555(src[i]);
+}
+
+static void
+row_rgb565_c(void* dst, const uint32_t* src, int w)
+{
+    uint16_t* d = dst;
+    int i;
+    for (i = 0; i < w; ++i)
+        d[i] = to_rgb565(src[i]);
+}
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+
+static inline uint32x4_t
+argb4444_neon(uint32x4_t p)
+{
+    return vorrq_u32(vorrq_u32(vandq_u32(vshrq_n_u32(p, 16), vdupq_n_u32(0xF000)),
+                               vandq_u32(vshrq_n_u32(p, 12), vdupq_n_u32(0x0F00))),
+                     vorrq_u32(vandq_u32(vshrq_n_u32(p, 8), vdupq_n_u32(0x00F0)),
+                               vandq_u32(vshrq_n_u32(p, 4), vdupq_n_u32(0x000F))));
+}
+
+static inline uint32x4_t
+argb1555_neon(uint32x4_t p)
+{
+    return vorrq_u32(vorrq_u32(vandq_u32(vshrq_n_u32(p, 16), vdupq_n_u32(0x8000)),
+                               vandq_u32(vshrq_n_u32(p, 9), vdupq_n_u32(0x7C00))),
+                     vorrq_u32(vandq_u32(vshrq_n_u32(p, 6), vdupq_n_u32(0x03E0)),
+                               vandq_u32(vshrq_n_u32(p, 3), vdupq_n_u32(0x001F))));
+}
+
+static inline uint32x4_t
+rgb565_neon(uint32x4_t p)
+{
+    uint32x4_t key = vdupq_n_u32(RGB565_KEY);
+    uint32x4_t v = vorrq_u32(vorrq_u32(vandq_u32(vshrq_n_u32(p, 8), vdupq_n_u32(0xF800)),
+                                       vandq_u32(vshrq_n_u32(p, 5), vdupq_n_u32(0x07E0))),
+                             vandq_u32(vshrq_n_u32(p, 3), vdupq_n_u32(0x001F)));
+    v = veorq_u32(v, vandq_u32(vceqq_u32(v, key), vdupq_n_u32(1)));
+    return vbslq_u32(vcgeq_u32(p, vdupq_n_u32(0x80000000)), v, key);
+}
+
+// scanout memory is write-combined, copy in bursts of whole cache lines
+static void
+row_argb8888_simd(void* dst, const uint32_t* src, int w)
+{
+    uint32_t* d = dst;
+    int i = 0;
+    for (; i + 16 <= w; i += 16)
+    {
+        uint32x4_t a = vld1q_u32(src + i);
+        uint32x4_t b = vld1q_u32(src + i + 4);
+        uint32x4_t c = vld1q_u32(src + i + 8);
+        uint32x4_t e = vld1q_u32(src + i + 12);
+        vst1q_u32(d + i, a);
+        vst1q_u32(d + i + 4, b);
+        vst1q_u32(d + i + 8, c);
+        vst1q_u32(d + i + 12, e);
+    }
+    row_argb8888_c(d + i, src + i, w - i);
+}
+
+#define DEFINE_ROW_SIMD(fmt) \
+static void \
+row_##fmt##_simd(void* dst, const uint32_t* src, int w) \
+{ \
+    uint16_t* d = dst; \
+    int i = 0; \
+    for (; i + 8 <= w; i += 8) \
+    { \
+        uint16x4_t lo = vmovn_u32(fmt##_neon(vld1q_u32(src + i))); \
+        uint16x4_t hi = vmovn_u32(fmt##_neon(vld1q_u32(src + i + 4))); \
+        vst1q_u16(d + i, vcombine_u16(lo, hi)); \
+    } \
+    row_##fmt##_c(d + i, src + i, w - i); \
+}
+
+#elif defined(__SSE2__)
+
+static inline __m128i
+argb4444_sse2(__m128i p)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), _mm_set1_epi32(0xF000)),
+                                     _mm_and_si128(_mm_srli_epi32(p, 12), _mm_set1_epi32(0x0F00))),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0x00F0)),
+                                     _mm_and_si128(_mm_srli_epi32(p, 4), _mm_set1_epi32(0x000F))));
+}
+
+static inline __m128i
+argb1555_sse2(__m128i p)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), _mm_set1_epi32(0x8000)),
+                                     _mm_and_si128(_mm_srli_epi32(p, 9), _mm_set1_epi32(0x7C00))),
+                        _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 6), _mm_set1_epi32(0x03E0)),
+                                     _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F))));
+}
+
+static inline __m128i
+rgb565_sse2(__m128i p)
+{
+    __m128i key = _mm_set1_epi32(RGB565_KEY);
+    __m128i opaque = _mm_srai_epi32(p, 31);
+    __m128i v = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800)),
+                                          _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0))),
+                             _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F)));
+    v = _mm_xor_si128(v, _mm_and_si128(_mm_cmpeq_epi32(v, key), _mm_set1_epi32(1)));
+    return _mm_or_si128(_mm_and_si128(opaque, v), _mm_andnot_si128(opaque, key));
+}
+
+// non-temporal stores keep the scanout buffer out of the cache
+static void
+row_argb8888_simd(void* dst, const uint32_t* src, int w)
+{
+    uint32_t* d = dst;
+    int i = 0;
+    for (; i < w && ((uintptr_t)(d + i) & 15); ++i)
+        d[i] = src[i];
+    for (; i + 4 <= w; i += 4)
+        _mm_stream_si128((__m128i*)(d + i), _mm_loadu_si128((const __m128i*)(src + i)));
+    row_argb8888_c(d + i, src + i, w - i);
+}
+
+// packs the low halves of 32 bit lanes, sign extension keeps packs from saturating
+static inline __m128i
+pack_u16_sse2(__m128i lo, __m128i hi)
+{
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    return _mm_packs_epi32(lo, hi);
+}
+
+#define DEFINE_ROW_SIMD(fmt) \
+static void \
+row_##fmt##_simd(void* dst, const uint32_t* src, int w) \
+{ \
+    uint16_t* d = dst; \
+    int i = 0; \
+    for (; i + 8 <= w; i += 8) \
+    { \
+        __m128i lo = fmt##_sse2(_mm_loadu_si128((const __m128i*)(src + i))); \
+        __m128i hi = fmt##_sse2(_mm_loadu_si128((const __m128i*)(src + i + 4))); \
+        _mm_storeu_si128((__m128i*)(d + i), pack_u16_sse2(lo, hi)); \
+    } \
+    row_##fmt##_c(d + i, src + i, w - i); \
+}
+
+#endif
+
+#ifdef DEFINE_ROW_SIMD
+DEFINE_ROW_SIMD(argb4444)
+DEFINE_ROW_SIMD(argb1555)
+DEFINE_ROW_SIMD(rgb565)
+#else
+#define row_argb8888_simd row_argb8888_c
+#define row_argb4444_simd row_argb4444_c
+#define row_argb1555_simd row_argb1555_c
+#define row_rgb565_simd row_rgb565_c
+#endif
+
+static const struct pixel_format s_formats[] = {
+    { "argb8888", DRM_FORMAT_ARGB8888, 4, 0, row_argb8888_simd, row_argb8888_c },
+    { "argb4444", DRM_FORMAT_ARGB4444, 2, 0, row_argb4444_simd, row_argb4444_c },
+    { "argb1555", DRM_FORMAT_ARGB1555, 2, 0, row_argb1555_simd, row_argb1555_c },
+    { "rgb565", DRM_FORMAT_RGB565, 2, RGB565_KEY, row_rgb565_simd, row_rgb565_c },
+};
+
+const struct pixel_format* eplay_pixel_format_find(const char* name)
+{
+    unsigned int i;
+    for (i = 0; i < sizeof(s_formats) / sizeof(s_formats[0]); ++i)
+        if (strcmp(s_formats[i].name, name) == 0)
+            return &s_formats[i];
+    return NULL;
+}
+
+void eplay_convert_rect(const struct pixel_format* fmt, void* dst, int dst_pitch,
+                        const void* src, int src_pitch, const Eina_Rectangle* r)
+{
+    const uint8_t* s = (const uint8_t*)src + r->y * src_pitch + r->x * 4;
+    uint8_t* d = (uint8_t*)dst + r->y * dst_pitch + r->x * fmt->cpp;
+    int y;
+
+    for (y = 0; y < r->h; ++y, s += src_pitch, d += dst_pitch)
+        fmt->convert_row(d, (const uint32_t*)s, r->w);
+
+#if defined(__SSE2__) && !(defined(__ARM_NEON__) || defined(__ARM_NEON))
+    _mm_sfence();
+#endif
+}
@@ -25,39 +25,288 @@
 #include <Elementary.h>
 #include <Eina.h>
 #include <Ecore_Evas.h>
+#include <Eet.h>
 
 #include <gst/gst.h>
 
 #include <alsa/asoundlib.h>
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 
+#define EPLAY_MAX_DAMAGE 16
+#define EPLAY_MAX_OV_BUFFERS 4
+#define EPLAY_TIMING_FRAMES 256 /* power of two */
+#define EPLAY_VIDEO_BUFFERS 4
+#define EPLAY_SEEK_SETTLE 0.25 /* s without key presses before a seek goes out */
+#define EPLAY_POSITION_RESYNC 5000000 /* us between real position queries */
+#define EPLAY_MEDIA_WORKERS 2
+#define EPLAY_MEDIA_TIMEOUT 5 /* s a worker spends on one file */
+#define EPLAY_KEY_SNAP 5 /* s at most a seek is moved to land on a key frame */
+#define EPLAY_READAHEAD_TIME 8 /* s of the stream read ahead of playback */
+#define EPLAY_LIST_BATCH 64 /* browser items appended per main loop iteration */
+#define EPLAY_LIST_BUDGET (4 * 1024 * 1024) /* bytes of directory listings kept in memory */
+#define EPLAY_THUMB_WIDTH 128
+#define EPLAY_STRINGSHARE_OVERHEAD 32 /* bytes eina spends on a shared string besides its text, 64 bit */
+#define EPLAY_THUMB_BUDGET (4 * 1024 * 1024) /* bytes of thumbnails kept in memory */
+
 struct drm_buffer
 {
-    struct omap_bo *bo;
+    struct omap_bo *bo; /* NULL for dumb buffers */
+    uint32_t handle;
     uint32_t fb_id;
     int width, height;
+    int pitch;
+    size_t size;
     void *data;
 };
 
+enum kms_plane_prop
+{
+    KMS_FB_ID,
+    KMS_CRTC_ID,
+    KMS_SRC_X,
+    KMS_SRC_Y,
+    KMS_SRC_W,
+    KMS_SRC_H,
+    KMS_CRTC_X,
+    KMS_CRTC_Y,
+    KMS_CRTC_W,
+    KMS_CRTC_H,
+    KMS_PLANE_PROP_COUNT
+};
+
+/* desired configuration of a plane, fb_id 0 disables it */
+struct kms_plane
+{
+    uint32_t id;
+    uint32_t props[KMS_PLANE_PROP_COUNT];
+    uint32_t fb_id;
+    int src_x, src_y, src_w, src_h;
+    int crtc_x, crtc_y, crtc_w, crtc_h;
+};
+
+struct pixel_format
+{
+    const char* name;
+    uint32_t fourcc;
+    int cpp;
+    uint32_t color_key; /* transparent value for formats without alpha, else 0 */
+    void (*convert_row)(void* dst, const uint32_t* src, int w);
+    void (*convert_row_ref)(void* dst, const uint32_t* src, int w); /* scalar reference */
+};
+
+/* list of rectangles touched by the renderer, collapsed to a bounding box on overflow */
+struct damage
+{
+    int count;
+    Eina_Rectangle rects[EPLAY_MAX_DAMAGE];
+};
+
+enum ov_state
+{
+    OV_FREE,
+    OV_RENDERING,
+    OV_QUEUED,
+    OV_SCANOUT
+};
+
+struct ov_buffer
+{
+    struct drm_buffer buf;
+    enum ov_state state;
+    struct damage stale; /* regions changed by newer frames */
+    uint64_t render_start; /* timestamps of the queued frame */
+    uint64_t switched;
+    unsigned int dirty_pixels;
+};
+
+/* memory layout of a planar or packed video frame */
+struct video_layout
+{
+    uint32_t fourcc; /* drm fourcc */
+    int planes;
+    int stride[3];
+    size_t offset[3];
+    int row_bytes[3];
+    int rows[3];
+    size_t size;
+};
+
+struct video_slot
+{
+    struct drm_buffer buf;
+    bool busy; /* owned by a GstBuffer */
+};
+
+/* key frame position, time in ns */
+struct key_entry
+{
+    int64_t time;
+    int64_t offset; /* bytes */
+};
+
+/* key frames of one file, mapped from the cache plus those seen while playing */
+struct key_index
+{
+    char path[PATH_MAX]; /* cache file, empty if there is none */
+    uint64_t inode, size, mtime;
+    void* map;
+    size_t map_size;
+    const struct key_entry* entries; /* sorted by time */
+    uint32_t count;
+    struct key_entry* added;
+    uint32_t added_count, added_size;
+    int64_t max_gap; /* widest distance between neighbouring key frames seen */
+};
+
+/* tuning hook work of one pipeline since its last open, bumped from its streaming threads */
+struct tune_counters
+{
+    uint64_t time; /* us */
+    unsigned int elements;
+    unsigned int props;
+};
+
+/* what the metadata workers found out about a file, strings are stringshares */
+struct media_info
+{
+    long long size, mtime; /* of the file when it was examined */
+    long long duration;    /* ns, 0 if unknown */
+    const char* container;
+    const char* video_codec;
+    const char* audio_codec;
+    int width, height;
+    int audio_tracks;
+};
+
+/* decoded thumbnail, pixels is NULL for files without a picture */
+struct thumbnail
+{
+    EINA_INLIST; /* least recently used first */
+    const char* path;
+    uint32_t* pixels;
+    int width, height;
+    size_t bytes;
+};
+
+/* entries of one directory, directories first, each part sorted */
+struct dir_listing
+{
+    EINA_INLIST; /* in the cache, least recently shown first */
+    char* path;
+    size_t path_len;
+    char* names;           /* all names back to back, zero terminated */
+    uint32_t* offsets;     /* of each entry's name in names */
+    unsigned char* types;  /* DT_ of each entry, resolved where the file system gave none */
+    long long* sizes;      /* bytes, -1 for directories and until known */
+    unsigned int count;
+    unsigned int dirs;
+    int refs;
+    int wd;                /* inotify watch, -1 if the mtime has to be checked */
+    long long mtime;       /* ns, of the directory when it was read */
+    int sized;             /* atomic, set once the size pass went through every file */
+    size_t bytes;
+    size_t shared_bytes;   /* the same as stringshares of full paths, for comparison */
+};
+
+/* order of the entries in the browser */
+enum eplay_sort_mode
+{
+    EPLAY_SORT_NATURAL, /* by locale, numbers by value */
+    EPLAY_SORT_COLLATE, /* by locale */
+    EPLAY_SORT_BYTES,   /* by byte value, fastest */
+};
+
+enum play_request_type
+{
+    PLAY_OPEN,
+    PLAY_START,
+    PLAY_PAUSE,
+    PLAY_SEEK,
+    PLAY_REQUEST_COUNT
+};
+
+/* queued playback control, carried out one state change at a time */
+struct play_request
+{
+    enum play_request_type type;
+    char* file;
+    gint64 position;
+    double rate;
+};
+
+struct transition_stats
+{
+    unsigned int count;
+    uint64_t total, max, last; /* us */
+};
+
+/* timings of one OSD frame in microseconds */
+struct frame_timing
+{
+    uint32_t render;  /* Evas render */
+    uint32_t commit;  /* switch to plane commit */
+    uint32_t scanout; /* commit to flip completion */
+    uint32_t missed;  /* vblanks missed on the way */
+    uint32_t dirty_pixels;
+};
+
+/* written by one producer, readers copy the newest entries */
+struct frame_timing_ring
+{
+    struct frame_timing frames[EPLAY_TIMING_FRAMES];
+    unsigned int head; /* frames pushed so far */
+};
+
 struct eplay
 {
     struct omap_device* dev;
+    const char* drm_device;
     int drm_fd;
     uint32_t c_id;
     uint32_t crtc;
+    int crtc_pipe;       /* index of crtc, for vblank requests */
     uint32_t planes[2];
+    bool atomic;
+    bool flip_pending;
+    bool commit_needed;
+    uint32_t flip_fb;
+    uint64_t flip_commit_time;
+    uint32_t flip_sequence;  /* vblank the commit should complete on */
+    bool flip_sequence_valid;
+    bool flip_ts_monotonic;
+    Ecore_Fd_Handler* drm_handler;
+    struct kms_plane ov_plane;
+    struct kms_plane ov_committed;
+    bool ov_plane_valid;
+    unsigned int kms_commits;
+    unsigned int kms_skipped;
     bool show_overlay;
-    int current_ov_buffer;
-    struct drm_buffer overlay[2];
+    bool ov_cropped;
+    Eina_Rectangle ov_crop;
+    int ov_scale;
+    const struct pixel_format* ov_format;
+    void* ov_shadow;
+    int ov_shadow_pitch;
+    int ov_count;
+    int ov_rendering; /* -1 while every buffer is queued or on screen */
+    int ov_latest;
+    struct ov_buffer overlay[EPLAY_MAX_OV_BUFFERS];
     struct drm_buffer bg;
+    struct damage ov_damage;
+    unsigned int ov_dirty_pixels;
+    uint64_t render_start;
+    unsigned int frame_time; /* refresh period in us */
+    struct frame_timing_ring timing;
 
     Ecore_Evas* ee;
     Evas_Object* win;
     Evas_Object* progress;
     Evas_Object* slider;
     Ecore_Timer* timer;
+    Ecore_Animator* progress_anim;
 
     Eina_List* input_handler;
 
@@ -71,9 +320,121 @@ struct eplay
     char current_path[PATH_MAX];
     Elm_Genlist_Item_Class *itc_dir;
     Elm_Genlist_Item_Class *itc_file;
+    pthread_t list_worker;
+    bool list_running;
+    bool list_quit;
+    char* list_request;            /* directory waiting for the worker */
+    unsigned int list_generation;  /* bumped by every scan, older results are dropped */
+    enum eplay_sort_mode list_sort;
+    unsigned int list_request_generation; /* of the scan that made the request */
+    long long list_request_mtime;  /* of the cached listing on screen, 0 if none */
+    struct dir_listing* list_request_unsized; /* that listing if its sizes are missing, referenced */
+    struct dir_listing* list_shown; /* in the browser, items refer to its entries by index */
+    unsigned int list_next;        /* entries appended so far */
+    Ecore_Idler* list_idler;
+    char* list_select;             /* name to select again once it is appended */
+    char list_next_file[PATH_MAX];
+    Eina_Hash* list_cache;         /* path to dir_listing */
+    Eina_Hash* list_watches;       /* inotify watch to dir_listing */
+    Eina_Inlist* list_lru;
+    size_t list_bytes;
+    int list_inotify;
+    Ecore_Fd_Handler* list_inotify_handler;
+    Ecore_Timer* list_refresh;
+    unsigned int list_hits;
+    unsigned int list_misses;
+    unsigned int list_invalidated;
+    unsigned int list_evicted;
 
     GstElement *playbin;
     gint64 duration;
+    Eina_List* play_queue;
+    struct play_request* play_active; /* waiting for the bus */
+    GstIndex* gst_index;
+    struct key_index key_index;
+    uint64_t play_started;
+    GstState play_state;  /* last state reached */
+    unsigned int play_generation; /* bumped by every open, bus events of older ones are dropped */
+    GstState play_target; /* state once the queue is done */
+    char* current_file;
+    char* next_file;      /* item after the current one */
+    GstElement* next_bin; /* prerolling next_file in the background */
+    bool next_ready;
+    uint64_t next_started;
+    gchar* next_uri;      /* for a gapless switch of audio-only content */
+    bool kmssink;
+    bool headless;        /* fake sinks, for benchmarks */
+    bool ttff_pending;
+    bool ttff_prerolled;
+    uint64_t ttff_started;
+    struct transition_stats ttff_stats[2]; /* cold, prerolled */
+    gint64 pos_value;     /* position at pos_clock_time */
+    GstClock* pos_clock;
+    GstClockTime pos_clock_time;
+    double pos_rate;
+    uint64_t pos_synced;
+    bool pos_valid;
+    unsigned int pos_queries;
+    unsigned int pos_estimates;
+    gint64 seek_target;   /* -1 without a pending seek */
+    Ecore_Timer* seek_timer;
+    double play_rate;
+    struct transition_stats play_stats[PLAY_REQUEST_COUNT];
+
+    Eina_Hash* media_info;     /* path -> struct media_info, checked this session */
+    Eet_File* media_cache;
+    Eet_Data_Descriptor* media_edd;
+    Eina_List* media_jobs;     /* paths waiting for a worker */
+    Eina_Hash* media_queued;   /* paths handed to the workers and not back yet */
+    pthread_t media_workers[EPLAY_MEDIA_WORKERS];
+    int media_worker_count;
+    bool media_quit;
+    unsigned int media_cache_hits;
+    unsigned int media_discovered;
+
+    pthread_t ra_thread;
+    bool ra_running;
+    bool ra_quit;
+    bool ra_update;        /* ra_file or ra_position changed */
+    char* ra_file;         /* to be opened by the prefetch thread */
+    gint64 ra_position;
+    int64_t ra_byterate;   /* average of the current file */
+    int ra_level;          /* buffering percentage, -1 if unknown */
+    int ra_shown;
+    bool ra_playing;
+    unsigned int ra_underruns;
+    unsigned int ra_total_underruns;
+    Ecore_Timer* ra_timer;
+
+    unsigned int tune_opens;
+    uint64_t tune_total;
+    uint64_t tune_scan_time;   /* of the scan after preroll, measured once */
+
+    Eina_Hash* thumbs;         /* path -> struct thumbnail */
+    Eina_Inlist* thumb_lru;
+    size_t thumb_bytes;
+    Eet_File* thumb_cache;     /* only touched by the thumbnail worker */
+    Eina_List* thumb_jobs;
+    pthread_t thumb_worker;
+    bool thumb_running;
+    bool thumb_quit;
+    unsigned int thumb_hits;
+    unsigned int thumb_decoded;
+    unsigned int thumb_loaded;
+    unsigned int thumb_cancelled;
+    unsigned int thumb_evicted;
+
+    GstCaps* video_caps;
+    struct video_layout video_src; /* as GStreamer lays out the frame */
+    struct video_layout video_dst; /* as the pool buffers are laid out */
+    bool video_direct; /* decoders can write into the pool */
+    struct video_slot video_slots[EPLAY_VIDEO_BUFFERS];
+    struct kms_plane video_plane;
+    GstBuffer* video_shown;
+    unsigned int video_zero_copy;
+    unsigned int video_copies;
+    unsigned int video_pool_hits;
+    unsigned int video_pool_misses;
 
     snd_mixer_t *mixer;
     snd_mixer_elem_t *mixer_elem;
@@ -93,7 +454,29 @@ bool eplay_setup_drm(struct eplay* ep);
 void eplay_cleanup_drm(struct eplay* ep);
 bool eplay_show_overlay(struct eplay* ep);
 void eplay_hide_overlay(struct eplay* ep);
+void eplay_set_overlay_crop(struct eplay* ep, const Eina_Rectangle* r);
 void* eplay_switch_overlay_buffer(void *data, void *dest_buffer);
+void* eplay_overlay_region_new(struct eplay* ep, int x, int y, int w, int h, int *row_bytes);
+void eplay_overlay_region_done(struct eplay* ep, int x, int y, int w, int h);
+bool eplay_alloc_drm_buffer(struct eplay* ep, struct drm_buffer* buf, int width, int height, int cpp);
+void eplay_destroy_drm_buffer(struct eplay* ep, struct drm_buffer* buf);
+bool eplay_plane_supports_format(int fd, uint32_t plane_id, uint32_t fourcc);
+void eplay_overlay_flipped(struct eplay* ep, uint32_t fb_id, uint64_t commit_time, uint64_t flip_time, int missed);
+
+const struct pixel_format* eplay_pixel_format_find(const char* name);
+void eplay_convert_rect(const struct pixel_format* fmt, void* dst, int dst_pitch,
+                        const void* src, int src_pitch, const Eina_Rectangle* r);
+
+bool eplay_setup_kms(struct eplay* ep);
+void eplay_cleanup_kms(struct eplay* ep);
+bool eplay_kms_commit(struct eplay* ep);
+bool eplay_kms_wait_flip(struct eplay* ep, int timeout_ms);
+bool eplay_kms_set_color_key(struct eplay* ep, uint32_t key);
+void eplay_kms_report(struct eplay* ep);
+
+uint64_t eplay_time_us(void);
+void eplay_timing_push(struct frame_timing_ring* r, const struct frame_timing* t);
+void eplay_timing_report(struct eplay* ep);
 
 bool eplay_setup_input(struct eplay* ep);
 void eplay_cleanup_input(struct eplay* ep);
@@ -101,16 +484,79 @@ void eplay_cleanup_input(struct eplay* ep);
 bool eplay_setup_gui(struct eplay* ep);
 void eplay_cleanup_gui(struct eplay* ep);
 void eplay_refresh_browser(struct eplay* ep);
+const char* eplay_next_file(struct eplay* ep, const char* file);
+void eplay_metadata_updated(struct eplay* ep, const char* path);
+void eplay_thumbnail_ready(struct eplay* ep, const char* path);
+void eplay_browser_show(struct eplay* ep, struct dir_listing* listing);
+void eplay_browser_update(struct eplay* ep);
+
+bool eplay_setup_listing(struct eplay* ep);
+void eplay_cleanup_listing(struct eplay* ep);
+void eplay_listing_scan(struct eplay* ep, const char* path);
+void eplay_listing_invalidate(struct eplay* ep);
+void eplay_listing_report(struct eplay* ep);
+struct dir_listing* eplay_listing_ref(struct dir_listing* listing);
+void eplay_listing_unref(struct dir_listing* listing);
+const char* eplay_listing_name(const struct dir_listing* listing, unsigned int i);
+bool eplay_listing_path(const struct dir_listing* listing, unsigned int i, char* path, size_t len);
+long long eplay_listing_size(const struct dir_listing* listing, unsigned int i);
+
+bool eplay_sort_mode_find(const char* name, enum eplay_sort_mode* mode);
+const char* eplay_sort_mode_name(enum eplay_sort_mode mode);
+unsigned int* eplay_sort_order(const char* const* names, unsigned int count, size_t skip,
+                               enum eplay_sort_mode mode);
 
 bool eplay_setup_gstreamer(struct eplay* ep);
 void eplay_cleanup_gstreamer(struct eplay* ep);
 
+GstElement* eplay_create_video_sink(struct eplay* ep, bool background);
+void eplay_video_sink_show(GstElement* sink);
+void eplay_cleanup_video(struct eplay* ep);
+void eplay_video_report(struct eplay* ep);
+
 void eplay_play(struct eplay* ep, const char* file);
+void eplay_play_next(struct eplay* ep);
 double eplay_seek(struct eplay* ep, int offset);
+double eplay_trick(struct eplay* ep, int direction);
+double eplay_get_rate(struct eplay* ep);
 void eplay_set_playing(struct eplay* ep, bool play);
 bool eplay_is_playing(struct eplay* ep);
 double eplay_get_progress(struct eplay* ep);
 void eplay_switch_audio(struct eplay* ep);
+void eplay_player_report(struct eplay* ep);
+
+bool eplay_index_open(struct key_index* idx, const char* file);
+void eplay_index_close(struct key_index* idx);
+void eplay_index_add(struct key_index* idx, int64_t time, int64_t offset);
+bool eplay_index_lookup(struct key_index* idx, int64_t time, bool after, struct key_entry* out);
+
+bool eplay_cache_dir(char* dir, size_t len, const char* name);
+
+bool eplay_setup_metadata(struct eplay* ep);
+void eplay_cleanup_metadata(struct eplay* ep);
+void eplay_metadata_scan_begin(struct eplay* ep);
+void eplay_metadata_scan(struct eplay* ep, const char* path);
+const struct media_info* eplay_metadata_get(struct eplay* ep, const char* path);
+void eplay_metadata_report(struct eplay* ep);
+void eplay_lower_priority(void);
+
+void eplay_tune_element(struct tune_counters* counters, GstElement* element);
+void eplay_tuning_opened(struct eplay* ep, GstElement* playbin, struct tune_counters* counters);
+void eplay_tuning_report(struct eplay* ep);
+
+bool eplay_setup_readahead(struct eplay* ep);
+void eplay_cleanup_readahead(struct eplay* ep);
+void eplay_readahead_element(struct eplay* ep, GstElement* element);
+void eplay_readahead_start(struct eplay* ep, const char* file);
+void eplay_readahead_update(struct eplay* ep, gint64 position);
+int eplay_readahead_level(struct eplay* ep);
+void eplay_readahead_report(struct eplay* ep);
+
+bool eplay_setup_thumbnails(struct eplay* ep);
+void eplay_cleanup_thumbnails(struct eplay* ep);
+const struct thumbnail* eplay_thumbnail_get(struct eplay* ep, const char* path);
+void eplay_thumbnail_cancel(struct eplay* ep, const char* path);
+void eplay_thumbnail_report(struct eplay* ep);
 
 bool eplay_setup_mixer(struct eplay* ep);
 void eplay_cleanup_mixer(struct eplay*ep);
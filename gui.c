@@ -29,18 +29,86 @@
 #include <Evas.h>
 #include <Eeze.h>
 
-#include <dirent.h>
 
-static char* itc_text_get(void *data, Evas_Object *obj, const char *source)
+// items hold the index of their entry in the listing on screen
+static unsigned int item_index(const void* data)
 {
-    // printf("%s:%i:\n", __FUNCTION__, __LINE__);
-    return elm_entry_utf8_to_markup(ecore_file_file_get(data)); /* NOTE this will be free()'d by the caller */
+    return (uintptr_t)data;
+}
+
+// full path of an item's entry, false once the item has outlived its listing
+static bool item_path(struct eplay* ep, const void* data, char* path, size_t len)
+{
+    const struct dir_listing* listing = ep->list_shown;
+
+    return listing && item_index(data) < listing->count &&
+           eplay_listing_path(listing, item_index(data), path, len);
 }
 
-static void itc_del(void *data, Evas_Object *obj)
+static char* itc_text_get(void *data, Evas_Object *obj, const char *source)
 {
+    struct eplay* ep = evas_object_data_get(obj, "eplay");
+    const struct media_info* info;
+    Eina_Strbuf* text;
+    char path[PATH_MAX];
+    char* name;
+
     // printf("%s:%i:\n", __FUNCTION__, __LINE__);
-    eina_stringshare_del(data);
+    if (!ep || !item_path(ep, data, path, sizeof(path)))
+        return NULL;
+    info = eplay_metadata_get(ep, path);
+    // like the thumbnails, only files in realized rows are looked at
+    if (!info && item_index(data) >= ep->list_shown->dirs)
+        eplay_metadata_scan(ep, path);
+    name = elm_entry_utf8_to_markup(eplay_listing_name(ep->list_shown, item_index(data))); /* NOTE this will be free()'d by the caller */
+    if (name && (!info || (!info->duration && !info->video_codec && !info->audio_codec)))
+    {
+        long long size = eplay_listing_size(ep->list_shown, item_index(data));
+        const char* unit[] = { "B", "kB", "MB", "GB", "TB" };
+        double v = size;
+        int u = 0;
+
+        if (size < 0)
+            return name;
+
+        // until the metadata is in, which has the size too
+        while (v >= 1000 && u < 4)
+        {
+            v /= 1024;
+            u++;
+        }
+        text = eina_strbuf_new();
+        eina_strbuf_append_printf(text, "%s  <em> %.*f %s</em>", name, u && v < 10, v, unit[u]);
+        free(name);
+        name = eina_strbuf_string_steal(text);
+        eina_strbuf_free(text);
+        return name;
+    }
+    if (!info || !name)
+        return name;
+
+    // details come in later from the metadata workers
+    text = eina_strbuf_new();
+    eina_strbuf_append_printf(text, "%s  <em>", name);
+    if (info->duration)
+    {
+        long long s = info->duration / GST_SECOND;
+        eina_strbuf_append_printf(text, " %lli:%02lli:%02lli", s / 3600, s / 60 % 60, s % 60);
+    }
+    if (info->width)
+        eina_strbuf_append_printf(text, " %ix%i", info->width, info->height);
+    if (info->video_codec)
+        eina_strbuf_append_printf(text, " %s", info->video_codec);
+    if (info->audio_codec)
+        eina_strbuf_append_printf(text, " %s", info->audio_codec);
+    if (info->audio_tracks > 1)
+        eina_strbuf_append_printf(text, " (%i tracks)", info->audio_tracks);
+    eina_strbuf_append(text, "</em>");
+    free(name);
+
+    name = eina_strbuf_string_steal(text);
+    eina_strbuf_free(text);
+    return name;
 }
 
 static Eina_Bool itc_state_get(void *data, Evas_Object *obj, const char *source)
@@ -64,6 +132,34 @@ static Evas_Object * itc_icon_file_get(void *data, Evas_Object *obj, const char
     return ic;
 }
 
+static Evas_Object * itc_icon_thumb_get(void *data, Evas_Object *obj, const char *source)
+{
+    struct eplay* ep = evas_object_data_get(obj, "eplay");
+    const struct media_info* info;
+    const struct thumbnail* t;
+    char path[PATH_MAX];
+    Evas_Object *img;
+
+    if (strcmp(source, "elm.swallow.icon")) return NULL;
+    if (!item_path(ep, data, path, sizeof(path)))
+        return itc_icon_file_get(data, obj, source);
+
+    // content_get only runs for realized items, the thumbnail is queued from here
+    info = eplay_metadata_get(ep, path);
+    if (info && !info->video_codec)
+        return itc_icon_file_get(data, obj, source);
+    t = eplay_thumbnail_get(ep, path);
+    if (!t || !t->pixels)
+        return itc_icon_file_get(data, obj, source);
+
+    img = evas_object_image_filled_add(evas_object_evas_get(obj));
+    evas_object_image_alpha_set(img, EINA_FALSE);
+    evas_object_image_size_set(img, t->width, t->height);
+    evas_object_image_data_copy_set(img, t->pixels);
+    evas_object_size_hint_aspect_set(img, EVAS_ASPECT_CONTROL_VERTICAL, t->width, t->height);
+    return img;
+}
+
 static Elm_Genlist_Item_Class * create_itc(Elm_Gen_Item_Content_Get_Cb cb)
 {
     Elm_Genlist_Item_Class *itc = elm_genlist_item_class_new();
@@ -71,97 +167,192 @@ static Elm_Genlist_Item_Class * create_itc(Elm_Gen_Item_Content_Get_Cb cb)
     itc->item_style = "default";
     itc->func.text_get = itc_text_get;
     itc->func.state_get = itc_state_get;
-    itc->func.del = itc_del;
+    itc->func.del = NULL;
     itc->func.content_get = cb;
 
     return itc;
 }
 
-static void populate_list(struct eplay* ep)
+static void stop_listing(struct eplay* ep)
 {
-    Evas_Object* fs = ep->win;
-    Eina_List *files = NULL, *dirs = NULL;
-    //Eina_List *files = NULL;
-    // //Eina_File_Direct_Info *file;
-    // const char *file;
-    // Eina_Iterator *it;
-    const char *entry;
+    if (ep->list_idler)
+        ecore_idler_del(ep->list_idler);
+    ep->list_idler = NULL;
+    free(ep->list_select);
+    ep->list_select = NULL;
+}
 
-    // if (!ecore_file_is_dir(ep->current_path)) return;
+// the items go first, they refer to the listing
+static void clear_listing(struct eplay* ep)
+{
+    stop_listing(ep);
+    elm_genlist_clear(ep->win);
+    eplay_listing_unref(ep->list_shown);
+    ep->list_shown = NULL;
+}
 
-    // it = eina_file_ls(ep->current_path);
-    // if (!it) return;
+static void append_entries(struct eplay* ep, unsigned int count)
+{
+    const struct dir_listing* listing = ep->list_shown;
+    unsigned int end = MIN(listing->count, ep->list_next + count);
 
-    // elm_genlist_clear(fs);
+    for (; ep->list_next < end; ep->list_next++)
+    {
+        void* data = (void*)(uintptr_t)ep->list_next;
+        Elm_Object_Item* item;
 
-    // EINA_ITERATOR_FOREACH (it, file)
-    // {
+        if (ep->list_next < listing->dirs)
+            item = elm_genlist_item_append(ep->win, ep->itc_dir, data, NULL, ELM_GENLIST_ITEM_NONE, NULL, NULL);
+        else
+            item = elm_genlist_item_append(ep->win, ep->itc_file, data, NULL, ELM_GENLIST_ITEM_NONE, NULL, NULL);
+
+        if (ep->list_select && strcmp(eplay_listing_name(listing, ep->list_next), ep->list_select) == 0)
+        {
+            elm_genlist_item_selected_set(item, EINA_TRUE);
+            elm_genlist_item_show(item, ELM_GENLIST_ITEM_SCROLLTO_IN);
+            free(ep->list_select);
+            ep->list_select = NULL;
+        }
+    }
+}
 
-    //     // const char *filename;
+static Eina_Bool append_idle_cb(void *data)
+{
+    struct eplay* ep = data;
 
-    //     // if (file->path[file->name_start] == '.') continue;
+    append_entries(ep, EPLAY_LIST_BATCH);
+    if (ep->list_next < ep->list_shown->count)
+        return ECORE_CALLBACK_RENEW;
 
-    //     // printf("%s\n", file->path);
+    ep->list_idler = NULL;
+    free(ep->list_select);
+    ep->list_select = NULL;
+    return ECORE_CALLBACK_CANCEL;
+}
 
-    //     // filename = eina_stringshare_add(file->path);
-    //     // if (file->type == EINA_FILE_DIR)
-    //     //     dirs = eina_list_append(dirs, filename);
-    //     // else
-    //     //     files = eina_list_append(files, filename);
-    //     files = eina_list_append(files, file);
-    // }
-    // eina_iterator_free(it);
+void eplay_browser_show(struct eplay* ep, struct dir_listing* listing)
+{
+    Elm_Object_Item* sel = elm_genlist_selected_item_get(ep->win);
+    char* select = NULL;
 
-    if (!ecore_file_is_dir(ep->current_path)) return;
+    // the user has moved on to another directory since
+    if (strcmp(listing->path, ep->current_path) != 0)
+    {
+        eplay_listing_unref(listing);
+        return;
+    }
 
-    elm_genlist_clear(fs);
+    // a changed directory is shown again with the cursor where it was
+    if (sel && ep->list_shown && item_index(elm_object_item_data_get(sel)) < ep->list_shown->count)
+        select = strdup(eplay_listing_name(ep->list_shown, item_index(elm_object_item_data_get(sel))));
+    clear_listing(ep);
+    ep->list_select = select;
+    ep->list_shown = listing;
+    ep->list_next = 0;
+
+    // the first screenful right away, the rest whenever the main loop has nothing to do
+    append_entries(ep, EPLAY_LIST_BATCH);
+    if (ep->list_next < listing->count)
+    {
+        ep->list_idler = ecore_idler_add(append_idle_cb, ep);
+    }
+    else
+    {
+        free(ep->list_select);
+        ep->list_select = NULL;
+    }
+}
 
-    DIR *dirp = opendir(ep->current_path);
-    struct dirent* ent;
-    char buf[1024];
+void eplay_browser_update(struct eplay* ep)
+{
+    elm_genlist_realized_items_update(ep->win);
+}
 
-    while ((ent = readdir(dirp)))
-    {
-        if (ent->d_name[0] == '.') continue;
-        snprintf(buf, sizeof(buf), "%s/%s", ep->current_path, ent->d_name);
+static void populate_list(struct eplay* ep)
+{
+    clear_listing(ep);
+    eplay_metadata_scan_begin(ep);
+    eplay_thumbnail_cancel(ep, NULL);
 
-        const char *filename = eina_stringshare_add(buf);
-        if (ent->d_type == DT_DIR)
-            dirs = eina_list_append(dirs, filename);
-        else
-            files = eina_list_append(files, filename);
-    }
+    eplay_listing_scan(ep, ep->current_path);
+}
 
-    closedir(dirp);
+static
+void update_path(struct eplay *ep, const char* path)
+{
+    strncpy(ep->current_path, path, sizeof(ep->current_path));
+    populate_list(ep);
+}
 
-    files = eina_list_sort(files, eina_list_count(files), EINA_COMPARE_CB(strcoll));
+static
+void crop_overlay(struct eplay* ep, Evas_Object* obj)
+{
+    Evas_Coord x, y, w, h;
+    Eina_Rectangle r;
 
-    dirs = eina_list_sort(dirs, eina_list_count(dirs), EINA_COMPARE_CB(strcoll));
+    // the browser needs the whole screen, during playback only the widget in use is scanned out
+    if (evas_object_visible_get(ep->win))
+    {
+        eplay_set_overlay_crop(ep, NULL);
+    }
+    else
+    {
+        evas_object_geometry_get(obj, &x, &y, &w, &h);
+        eina_rectangle_coords_from(&r, x, y, w, h);
+        eplay_set_overlay_crop(ep, &r);
+    }
+}
+
+static
+Eina_Bool progress_anim_cb(void *data)
+{
+    struct eplay *ep = data;
+    int level;
 
-    EINA_LIST_FREE(dirs, entry)
+    if (!ep->show_overlay || evas_object_visible_get(ep->win))
     {
-        elm_genlist_item_append(fs, ep->itc_dir, entry, NULL, ELM_GENLIST_ITEM_NONE, NULL, NULL);
+        ep->progress_anim = NULL;
+        return ECORE_CALLBACK_CANCEL;
     }
 
-    EINA_LIST_FREE(files, entry)
+    // cheap now that the position comes from the clock
+    elm_progressbar_value_set(ep->progress, eplay_get_progress(ep));
+
+    level = eplay_readahead_level(ep);
+    if (level != ep->ra_shown)
     {
-        elm_genlist_item_append(fs, ep->itc_file, entry, NULL, ELM_GENLIST_ITEM_NONE, NULL, NULL);
+        char text[32] = "";
+
+        if (level >= 0)
+            snprintf(text, sizeof(text), "buffer %i%%", level);
+        elm_object_text_set(ep->progress, text);
+        ep->ra_shown = level;
     }
+    return ECORE_CALLBACK_RENEW;
 }
 
 static
-void update_path(struct eplay *ep, const char* path)
+void show_osd(struct eplay* ep, Evas_Object* obj)
 {
-    strncpy(ep->current_path, path, sizeof(ep->current_path));
-    populate_list(ep);
+    crop_overlay(ep, obj);
+    if (!ep->show_overlay)
+        eplay_show_overlay(ep);
+
+    // the progress bar moves every frame while it is on screen
+    if (obj == ep->progress && !ep->progress_anim)
+        ep->progress_anim = ecore_animator_add(progress_anim_cb, ep);
 }
 
 static void item_sel_cb(void *data, Evas_Object *obj, void *event_info)
 {
     printf("sel item data [%p] on genlist obj [%p], item pointer [%p]\n", data, obj, event_info);
-    const char* file = elm_object_item_data_get(event_info);
     struct eplay* ep = data;
-    if (ecore_file_is_dir(file))
+    char file[PATH_MAX];
+
+    if (!item_path(ep, elm_object_item_data_get(event_info), file, sizeof(file)))
+        return;
+    // the listing has resolved the type already
+    if (elm_genlist_item_item_class_get(event_info) == ep->itc_dir)
     {
         update_path(ep, file);
     }
@@ -171,6 +362,7 @@ static void item_sel_cb(void *data, Evas_Object *obj, void *event_info)
         evas_object_focus_set(ep->progress, EINA_TRUE);
         evas_object_hide(ep->win);
         eplay_hide_overlay(ep);
+        crop_overlay(ep, ep->progress);
     }
 }
 
@@ -184,6 +376,7 @@ void menu_control_cb(void *data, Evas *e, Evas_Object *obj, void *event_info)
     {
         evas_object_focus_set(ep->progress, EINA_TRUE);
         evas_object_hide(ep->win);
+        crop_overlay(ep, ep->progress);
     }
     else if (strcmp(ev->keyname, "BackSpace") == 0)
     {
@@ -218,22 +411,40 @@ void control_cb(void *data, Evas *e, Evas_Object *obj, void *event_info)
     if (strcmp(ev->keyname, "Left") == 0)
     {
         elm_progressbar_value_set(obj, eplay_seek(ep, -5));
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
     }
     else if (strcmp(ev->keyname, "Right") == 0)
     {
         elm_progressbar_value_set(obj, eplay_seek(ep, 5));
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
     }
     else if (strcmp(ev->keyname, "Up") == 0)
     {
         elm_progressbar_value_set(obj, eplay_seek(ep, -30));
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
     }
     else if (strcmp(ev->keyname, "Down") == 0)
     {
         elm_progressbar_value_set(obj, eplay_seek(ep, 30));
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
+    }
+    else if (strcmp(ev->keyname, "XF86AudioForward") == 0 || strcmp(ev->keyname, "f") == 0)
+    {
+        eplay_trick(ep, 1);
+        elm_progressbar_value_set(obj, eplay_get_progress(ep));
+        show_osd(ep, obj);
+    }
+    else if (strcmp(ev->keyname, "XF86AudioRewind") == 0 || strcmp(ev->keyname, "r") == 0)
+    {
+        eplay_trick(ep, -1);
+        elm_progressbar_value_set(obj, eplay_get_progress(ep));
+        show_osd(ep, obj);
+    }
+    else if (strcmp(ev->keyname, "space") == 0 && eplay_get_rate(ep) != 1.0)
+    {
+        // leave fast forward or rewind first
+        eplay_trick(ep, 0);
+        elm_progressbar_value_set(obj, eplay_get_progress(ep));
     }
     else if (strcmp(ev->keyname, "space") == 0)
     {
@@ -241,7 +452,7 @@ void control_cb(void *data, Evas *e, Evas_Object *obj, void *event_info)
         elm_progressbar_value_set(obj, eplay_get_progress(ep));
         delete_timer(ep);
         if (playing)
-            eplay_show_overlay(ep);
+            show_osd(ep, obj);
         else
             eplay_hide_overlay(ep);
     }
@@ -249,11 +460,18 @@ void control_cb(void *data, Evas *e, Evas_Object *obj, void *event_info)
     {
         evas_object_show(ep->win);
         evas_object_focus_set(ep->win, EINA_TRUE);
+        eplay_set_overlay_crop(ep, NULL);
+        eplay_show_overlay(ep);
     }
     else if (strcmp(ev->keyname, "a") == 0)
     {
         eplay_switch_audio(ep);
     }
+    else if (strcmp(ev->keyname, "n") == 0 || strcmp(ev->keyname, "XF86AudioNext") == 0)
+    {
+        eplay_play_next(ep);
+        elm_progressbar_value_set(obj, 0.0);
+    }
 }
 
 static
@@ -283,18 +501,18 @@ void volume_cb(void *data, Evas *e, Evas_Object *obj, void *event_info)
     if (strcmp(ev->keyname, "XF86AudioLowerVolume") == 0)
     {
         eplay_set_volume(ep, vol - 1);
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
     }
     else if (strcmp(ev->keyname, "XF86AudioRaiseVolume") == 0)
     {
         eplay_set_volume(ep, vol + 1);
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
     }
     else if (strcmp(ev->keyname, "XF86AudioMute") == 0)
     {
         //elm_progressbar_value_set(obj, eplay_seek(ep, -20));
         printf("todo\n");
-        eplay_show_overlay(ep);
+        show_osd(ep, obj);
     }
 
     if (!show)
@@ -305,8 +523,69 @@ void volume_cb(void *data, Evas *e, Evas_Object *obj, void *event_info)
     elm_slider_value_set(obj, (double)eplay_get_volume(ep));
 }
 
+const char* eplay_next_file(struct eplay* ep, const char* file)
+{
+    const struct dir_listing* listing = ep->list_shown;
+    unsigned int i;
+
+    // only while the file's directory is on screen
+    if (!file || !listing || strncmp(file, listing->path, listing->path_len) != 0 ||
+        file[listing->path_len] != '/')
+        return NULL;
+
+    for (i = listing->dirs; i + 1 < listing->count; ++i)
+    {
+        if (strcmp(eplay_listing_name(listing, i), file + listing->path_len + 1) == 0)
+            return eplay_listing_path(listing, i + 1, ep->list_next_file, sizeof(ep->list_next_file)) ?
+                   ep->list_next_file : NULL;
+    }
+    return NULL;
+}
+
+static void update_realized(struct eplay* ep, const char* path, const char* part, Elm_Genlist_Item_Field_Type type)
+{
+    const struct dir_listing* listing = ep->list_shown;
+    Eina_List* items;
+    Elm_Object_Item* it;
+
+    if (!listing || strncmp(path, listing->path, listing->path_len) != 0 || path[listing->path_len] != '/')
+        return;
+
+    // items scrolled out of view pick it up once they are realized again
+    items = elm_genlist_realized_items_get(ep->win);
+    EINA_LIST_FREE(items, it)
+    {
+        unsigned int i = item_index(elm_object_item_data_get(it));
+
+        if (i < listing->count && strcmp(eplay_listing_name(listing, i), path + listing->path_len + 1) == 0)
+            elm_genlist_item_fields_update(it, part, type);
+    }
+}
+
+void eplay_metadata_updated(struct eplay* ep, const char* path)
+{
+    update_realized(ep, path, "elm.text", ELM_GENLIST_ITEM_FIELD_TEXT);
+}
+
+void eplay_thumbnail_ready(struct eplay* ep, const char* path)
+{
+    update_realized(ep, path, "elm.swallow.icon", ELM_GENLIST_ITEM_FIELD_CONTENT);
+}
+
+static void item_unrealized_cb(void *data, Evas_Object *obj, void *event_info)
+{
+    struct eplay* ep = data;
+    char path[PATH_MAX];
+
+    // scrolled away before its thumbnail was started
+    if (item_path(ep, elm_object_item_data_get(event_info), path, sizeof(path)))
+        eplay_thumbnail_cancel(ep, path);
+}
+
 void eplay_refresh_browser(struct eplay* ep)
 {
+    // mounts come and go without inotify events for the directories above them
+    eplay_listing_invalidate(ep);
     populate_list(ep);
 }
 
@@ -340,12 +619,16 @@ bool eplay_setup_gui(struct eplay* ep)
     
     fs = elm_genlist_add(hbox);
     elm_genlist_mode_set(fs, ELM_LIST_LIMIT);
-    ep->itc_file = create_itc(itc_icon_file_get);
+    // all rows are the same height, items are only realized as they scroll into view
+    elm_genlist_homogeneous_set(fs, EINA_TRUE);
+    ep->itc_file = create_itc(itc_icon_thumb_get);
     ep->itc_dir = create_itc(itc_icon_file_get);
     ep->win = fs;
+    evas_object_data_set(fs, "eplay", ep);
     evas_object_size_hint_weight_set(fs, EVAS_HINT_EXPAND, EVAS_HINT_EXPAND);
     evas_object_size_hint_align_set(fs, 0.0, EVAS_HINT_FILL);
     evas_object_smart_callback_add(fs, "activated", item_sel_cb, ep);
+    evas_object_smart_callback_add(fs, "unrealized", item_unrealized_cb, ep);
     //elm_win_resize_object_add(win, fs);
     elm_box_pack_end(hbox, fs);
     evas_object_show(fs);
@@ -378,7 +661,7 @@ bool eplay_setup_gui(struct eplay* ep)
     bg = elm_bg_add(ep->progress);
     elm_bg_color_set(bg, 255, 0, 0);
 
-    evas_object_resize(win, ep->overlay[0].width, ep->overlay[0].height);
+    evas_object_resize(win, ep->overlay[0].buf.width, ep->overlay[0].buf.height);
     //elm_win_focus_highlight_enabled_set(win, EINA_TRUE);
     evas_object_show(win);
 
@@ -400,6 +683,10 @@ bool eplay_setup_gui(struct eplay* ep)
 void eplay_cleanup_gui(struct eplay* ep)
 {
     delete_timer(ep);
+    clear_listing(ep);
+    if (ep->progress_anim)
+        ecore_animator_del(ep->progress_anim);
+    ep->progress_anim = NULL;
     elm_genlist_item_class_free(ep->itc_file);
     elm_genlist_item_class_free(ep->itc_dir);
 }
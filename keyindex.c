@@ -0,0 +1,291 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "eplay.h"
+#include <Ecore_File.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define INDEX_MAGIC 0x78646b65 /* "ekdx" */
+#define INDEX_VERSION 1
+
+/* on-disk layout: header followed by entries sorted by time */
+struct index_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t mtime;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+// demuxers add entries from their streaming threads
+static pthread_mutex_t s_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool eplay_cache_dir(char* dir, size_t len, const char* name)
+{
+    const char* base = getenv("XDG_CACHE_HOME");
+
+    if (base && base[0])
+        snprintf(dir, len, "%s/eplay/%s", base, name);
+    else if ((base = getenv("HOME")))
+        snprintf(dir, len, "%s/.cache/eplay/%s", base, name);
+    else
+        return false;
+
+    return ecore_file_mkpath(dir);
+}
+
+// gaps beyond the snap distance are jumps of a seek rather than one GOP
+static void
+note_gap(struct key_index* idx, int64_t gap)
+{
+    if (gap > idx->max_gap && gap <= EPLAY_KEY_SNAP * GST_SECOND)
+        idx->max_gap = gap;
+}
+
+bool eplay_index_open(struct key_index* idx, const char* file)
+{
+    struct stat st;
+    char dir[PATH_MAX];
+    const struct index_header* h;
+    int fd;
+
+    memset(idx, 0, sizeof(*idx));
+
+    if (stat(file, &st) != 0 || !eplay_cache_dir(dir, sizeof(dir), "index"))
+        return false;
+
+    // the cache entry belongs to this exact file, a changed file gets a new one
+    idx->inode = st.st_ino;
+    idx->size = st.st_size;
+    idx->mtime = st.st_mtime;
+    snprintf(idx->path, sizeof(idx->path), "%s/%llx-%llx-%llx.idx", dir,
+             (unsigned long long)idx->inode, (unsigned long long)idx->size,
+             (unsigned long long)idx->mtime);
+
+    fd = open(idx->path, O_RDONLY);
+    if (fd < 0)
+        return true;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*h))
+    {
+        idx->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (idx->map == MAP_FAILED)
+            idx->map = NULL;
+        else
+            idx->map_size = st.st_size;
+    }
+    close(fd);
+
+    h = idx->map;
+    if (h && h->magic == INDEX_MAGIC && h->version == INDEX_VERSION &&
+        h->inode == idx->inode && h->size == idx->size && h->mtime == idx->mtime &&
+        sizeof(*h) + (size_t)h->count * sizeof(struct key_entry) <= idx->map_size)
+    {
+        uint32_t i;
+
+        idx->entries = (const struct key_entry*)(h + 1);
+        idx->count = h->count;
+        for (i = 1; i < idx->count; ++i)
+            note_gap(idx, idx->entries[i].time - idx->entries[i - 1].time);
+        printf("index: %u key frames cached for '%s'\n", idx->count, file);
+    }
+    else if (idx->map)
+    {
+        munmap(idx->map, idx->map_size);
+        idx->map = NULL;
+    }
+    return true;
+}
+
+// binary search in the cached entries, index of the first entry not before time
+static uint32_t
+lower_bound(const struct key_entry* e, uint32_t count, int64_t time)
+{
+    uint32_t lo = 0, hi = count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (e[mid].time < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void eplay_index_add(struct key_index* idx, int64_t time, int64_t offset)
+{
+    uint32_t i;
+
+    if (!idx->path[0])
+        return;
+
+    // already known from a previous run
+    i = lower_bound(idx->entries, idx->count, time);
+    if (i < idx->count && idx->entries[i].time == time)
+        return;
+
+    pthread_mutex_lock(&s_index_lock);
+    if (idx->added_count == idx->added_size)
+    {
+        uint32_t size = idx->added_size ? idx->added_size * 2 : 256;
+        struct key_entry* e = realloc(idx->added, size * sizeof(*e));
+        if (!e)
+        {
+            pthread_mutex_unlock(&s_index_lock);
+            return;
+        }
+        idx->added = e;
+        idx->added_size = size;
+    }
+    // demuxers mostly add in stream order, the previous entry is the key frame before
+    if (idx->added_count)
+        note_gap(idx, time - idx->added[idx->added_count - 1].time);
+    else if (i > 0)
+        note_gap(idx, time - idx->entries[i - 1].time);
+    idx->added[idx->added_count].time = time;
+    idx->added[idx->added_count].offset = offset;
+    idx->added_count++;
+    pthread_mutex_unlock(&s_index_lock);
+}
+
+static void
+closer(const struct key_entry* e, int64_t time, bool after, const struct key_entry** best)
+{
+    if (after ? e->time < time : e->time > time)
+        return;
+    if (!*best || (after ? e->time < (*best)->time : e->time > (*best)->time))
+        *best = e;
+}
+
+bool eplay_index_lookup(struct key_index* idx, int64_t time, bool after, struct key_entry* out)
+{
+    const struct key_entry* best = NULL;
+    uint32_t i = lower_bound(idx->entries, idx->count, time);
+
+    if (i < idx->count)
+        closer(&idx->entries[i], time, after, &best);
+    if (i > 0)
+        closer(&idx->entries[i - 1], time, after, &best);
+
+    pthread_mutex_lock(&s_index_lock);
+    for (i = 0; i < idx->added_count; ++i)
+        closer(&idx->added[i], time, after, &best);
+    // a key frame further away than a GOP is not the one the demuxer picks,
+    // it only means the stretch in between was never played
+    if (best && llabs(best->time - time) > idx->max_gap)
+        best = NULL;
+    if (best)
+        *out = *best;
+    pthread_mutex_unlock(&s_index_lock);
+
+    return best != NULL;
+}
+
+static int
+compare_entry(const void* a, const void* b)
+{
+    const struct key_entry *x = a, *y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+// merges the new entries into the cached ones and replaces the cache file
+static void
+save(struct key_index* idx)
+{
+    struct index_header h = {
+        .magic = INDEX_MAGIC,
+        .version = INDEX_VERSION,
+        .inode = idx->inode,
+        .size = idx->size,
+        .mtime = idx->mtime,
+    };
+    struct key_entry* all;
+    char tmp[PATH_MAX + 8];
+    uint32_t i = 0, j = 0, n = 0;
+    FILE* f;
+    bool ok;
+
+    qsort(idx->added, idx->added_count, sizeof(*idx->added), compare_entry);
+
+    all = malloc((idx->count + idx->added_count) * sizeof(*all));
+    if (!all)
+        return;
+
+    while (i < idx->count || j < idx->added_count)
+    {
+        const struct key_entry* e;
+        if (j == idx->added_count || (i < idx->count && idx->entries[i].time <= idx->added[j].time))
+            e = &idx->entries[i++];
+        else
+            e = &idx->added[j++];
+
+        if (n == 0 || all[n - 1].time != e->time)
+            all[n++] = *e;
+    }
+    h.count = n;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", idx->path);
+    // written aside and renamed, a running reader keeps its mapping of the old file
+    f = fopen(tmp, "wb");
+    ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(all, sizeof(*all), n, f) == n;
+    if (f && fclose(f) != 0)
+        ok = false;
+
+    if (ok && rename(tmp, idx->path) == 0)
+    {
+        printf("index: %u key frames stored\n", n);
+    }
+    else
+    {
+        fprintf(stderr, "index: failed to write '%s': %s\n", tmp, strerror(errno));
+        unlink(tmp);
+    }
+    free(all);
+}
+
+void eplay_index_close(struct key_index* idx)
+{
+    if (idx->added_count)
+        save(idx);
+
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    free(idx->added);
+    memset(idx, 0, sizeof(*idx));
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const char* s_plane_prop_names[KMS_PLANE_PROP_COUNT] = {
+    [KMS_FB_ID] = "FB_ID",
+    [KMS_CRTC_ID] = "CRTC_ID",
+    [KMS_SRC_X] = "SRC_X",
+    [KMS_SRC_Y] = "SRC_Y",
+    [KMS_SRC_W] = "SRC_W",
+    [KMS_SRC_H] = "SRC_H",
+    [KMS_CRTC_X] = "CRTC_X",
+    [KMS_CRTC_Y] = "CRTC_Y",
+    [KMS_CRTC_W] = "CRTC_W",
+    [KMS_CRTC_H] = "CRTC_H",
+};
+
+static bool
+lookup_plane_props(int fd, struct kms_plane* plane)
+{
+    drmModeObjectProperties* props;
+    uint32_t i;
+    int j, found = 0;
+
+    props = drmModeObjectGetProperties(fd, plane->id, DRM_MODE_OBJECT_PLANE);
+    if (!props)
+        return false;
+
+    for (i = 0; i < props->count_props; ++i)
+    {
+        drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop)
+            continue;
+
+        for (j = 0; j < KMS_PLANE_PROP_COUNT; ++j)
+        {
+            if (strcmp(prop->name, s_plane_prop_names[j]) == 0)
+            {
+                plane->props[j] = prop->prop_id;
+                ++found;
+            }
+        }
+
+        drmModeFreeProperty(prop);
+    }
+
+    drmModeFreeObjectProperties(props);
+
+    return found == KMS_PLANE_PROP_COUNT;
+}
+
+// current vblank count of our crtc
+static bool
+vblank_sequence(struct eplay* ep, uint32_t* sequence)
+{
+    drmVBlank vbl;
+
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = DRM_VBLANK_RELATIVE;
+    if (ep->crtc_pipe == 1)
+        vbl.request.type |= DRM_VBLANK_SECONDARY;
+    else if (ep->crtc_pipe > 1)
+        vbl.request.type |= (ep->crtc_pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+
+    if (drmWaitVBlank(ep->drm_fd, &vbl) != 0)
+        return false;
+    *sequence = vbl.reply.sequence;
+    return true;
+}
+
+static int
+missed_vblanks(uint32_t expected, uint32_t sequence)
+{
+    int32_t late = sequence - expected;
+    return late > 0 ? late : 0;
+}
+
+static void
+page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+    struct eplay* ep = user_data;
+    uint64_t flip_time;
+
+    if (ep->flip_ts_monotonic)
+        flip_time = (uint64_t)tv_sec * 1000000 + tv_usec;
+    else
+        flip_time = eplay_time_us();
+
+    ep->flip_pending = false;
+    eplay_overlay_flipped(ep, ep->flip_fb, ep->flip_commit_time, flip_time,
+                          ep->flip_sequence_valid ? missed_vblanks(ep->flip_sequence, sequence) : -1);
+
+    if (ep->commit_needed)
+    {
+        ep->commit_needed = false;
+        eplay_kms_commit(ep);
+    }
+}
+
+static void
+dispatch_events(struct eplay* ep)
+{
+    drmEventContext evctx = {
+        .version = DRM_EVENT_CONTEXT_VERSION,
+        .page_flip_handler = page_flip_handler,
+    };
+
+    drmHandleEvent(ep->drm_fd, &evctx);
+}
+
+static Eina_Bool
+handle_drm_event(void *data, Ecore_Fd_Handler *handler)
+{
+    struct eplay* ep = data;
+
+    if (ecore_main_fd_handler_active_get(handler, ECORE_FD_ERROR))
+    {
+        printf("An error has occurred. Stop watching this fd.\n");
+        ep->drm_handler = NULL;
+        return ECORE_CALLBACK_CANCEL;
+    }
+
+    dispatch_events(ep);
+
+    return ECORE_CALLBACK_RENEW;
+}
+
+static void
+add_plane_props(drmModeAtomicReqPtr req, uint32_t crtc, const struct kms_plane* p)
+{
+    const uint32_t* id = p->props;
+
+    if (p->fb_id)
+    {
+        drmModeAtomicAddProperty(req, p->id, id[KMS_FB_ID], p->fb_id);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_CRTC_ID], crtc);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_SRC_X], p->src_x << 16);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_SRC_Y], p->src_y << 16);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_SRC_W], p->src_w << 16);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_SRC_H], p->src_h << 16);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_CRTC_X], p->crtc_x);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_CRTC_Y], p->crtc_y);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_CRTC_W], p->crtc_w);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_CRTC_H], p->crtc_h);
+    }
+    else
+    {
+        drmModeAtomicAddProperty(req, p->id, id[KMS_FB_ID], 0);
+        drmModeAtomicAddProperty(req, p->id, id[KMS_CRTC_ID], 0);
+    }
+}
+
+static bool
+atomic_commit(struct eplay* ep)
+{
+    drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+    int ret;
+
+    if (!req)
+        return false;
+
+    add_plane_props(req, ep->crtc, &ep->ov_plane);
+
+    // the commit is due on the vblank after the current one, the event tells where it landed
+    ep->flip_sequence_valid = vblank_sequence(ep, &ep->flip_sequence);
+    ep->flip_sequence++;
+    ep->flip_commit_time = eplay_time_us();
+    ret = drmModeAtomicCommit(ep->drm_fd, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, ep);
+    drmModeAtomicFree(req);
+
+    if (ret)
+    {
+        fprintf(stderr, "drmModeAtomicCommit failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    ep->flip_pending = true;
+    ep->flip_fb = ep->ov_plane.fb_id;
+    return true;
+}
+
+static bool
+legacy_commit(struct eplay* ep)
+{
+    const struct kms_plane* p = &ep->ov_plane;
+    uint64_t commit_time = eplay_time_us();
+    uint32_t before, after;
+    bool counted = vblank_sequence(ep, &before);
+    int ret;
+
+    if (p->fb_id)
+        ret = drmModeSetPlane(ep->drm_fd, p->id, ep->crtc, p->fb_id, 0,
+                    p->crtc_x, p->crtc_y, p->crtc_w, p->crtc_h,
+                    p->src_x << 16, p->src_y << 16, p->src_w << 16, p->src_h << 16);
+    else
+        ret = drmModeSetPlane(ep->drm_fd, p->id, ep->crtc, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    if (ret)
+    {
+        fprintf(stderr, "drmModeSetPlane failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    // no completion event, the update is visible once the ioctl returns,
+    // which may wait for one vblank but not for more
+    counted = counted && vblank_sequence(ep, &after);
+    eplay_overlay_flipped(ep, p->fb_id, commit_time, eplay_time_us(),
+                          counted ? missed_vblanks(before + 1, after) : -1);
+    return true;
+}
+
+static bool
+plane_equal(const struct kms_plane* a, const struct kms_plane* b)
+{
+    if (a->fb_id != b->fb_id)
+        return false;
+
+    return a->fb_id == 0 ||
+        (a->src_x == b->src_x && a->src_y == b->src_y &&
+         a->src_w == b->src_w && a->src_h == b->src_h &&
+         a->crtc_x == b->crtc_x && a->crtc_y == b->crtc_y &&
+         a->crtc_w == b->crtc_w && a->crtc_h == b->crtc_h);
+}
+
+bool eplay_kms_commit(struct eplay* ep)
+{
+    bool ok;
+
+    // nothing changed since the last commit (or the one in flight)
+    if (ep->ov_plane_valid && plane_equal(&ep->ov_plane, &ep->ov_committed))
+    {
+        ep->commit_needed = false;
+        ++ep->kms_skipped;
+        return true;
+    }
+
+    // only one flip in flight, the latest state goes out when it completes
+    if (ep->flip_pending)
+    {
+        ep->commit_needed = true;
+        return true;
+    }
+
+    ok = ep->atomic ? atomic_commit(ep) : legacy_commit(ep);
+    if (ok)
+    {
+        ep->ov_committed = ep->ov_plane;
+        ep->ov_plane_valid = true;
+        ++ep->kms_commits;
+    }
+    return ok;
+}
+
+void eplay_kms_report(struct eplay* ep)
+{
+    printf("kms: %u plane updates committed, %u skipped as unchanged\n", ep->kms_commits, ep->kms_skipped);
+}
+
+bool eplay_kms_wait_flip(struct eplay* ep, int timeout_ms)
+{
+    struct pollfd pfd = {
+        .fd = ep->drm_fd,
+        .events = POLLIN,
+    };
+
+    if (ep->flip_pending && poll(&pfd, 1, timeout_ms) > 0)
+        dispatch_events(ep);
+
+    return !ep->flip_pending;
+}
+
+static uint32_t
+find_crtc_prop(int fd, uint32_t crtc, const char* name, drmModePropertyPtr* out)
+{
+    drmModeObjectProperties* props = drmModeObjectGetProperties(fd, crtc, DRM_MODE_OBJECT_CRTC);
+    uint32_t i, id = 0;
+
+    for (i = 0; props && i < props->count_props && !id; ++i)
+    {
+        drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop)
+            continue;
+
+        if (strcmp(prop->name, name) == 0)
+        {
+            id = prop->prop_id;
+            if (out)
+            {
+                *out = prop;
+                prop = NULL;
+            }
+        }
+
+        if (prop)
+            drmModeFreeProperty(prop);
+    }
+
+    if (props)
+        drmModeFreeObjectProperties(props);
+    return id;
+}
+
+bool eplay_kms_set_color_key(struct eplay* ep, uint32_t key)
+{
+    drmModePropertyPtr mode_prop = NULL;
+    uint32_t mode_id = find_crtc_prop(ep->drm_fd, ep->crtc, "trans-key-mode", &mode_prop);
+    uint32_t key_id = find_crtc_prop(ep->drm_fd, ep->crtc, "trans-key", NULL);
+    uint64_t mode = 0;
+    int i;
+
+    if (!mode_id || !key_id)
+    {
+        if (mode_prop)
+            drmModeFreeProperty(mode_prop);
+        return false;
+    }
+
+    // the OSD sits on a video pipeline, key on its source pixels
+    for (i = 0; i < mode_prop->count_enums; ++i)
+        if (strcmp(mode_prop->enums[i].name, "video-source") == 0)
+            mode = mode_prop->enums[i].value;
+    drmModeFreeProperty(mode_prop);
+
+    return mode &&
+        drmModeObjectSetProperty(ep->drm_fd, ep->crtc, DRM_MODE_OBJECT_CRTC, key_id, key) == 0 &&
+        drmModeObjectSetProperty(ep->drm_fd, ep->crtc, DRM_MODE_OBJECT_CRTC, mode_id, mode) == 0;
+}
+
+bool eplay_setup_kms(struct eplay* ep)
+{
+    uint64_t cap = 0;
+
+    ep->ov_plane.id = ep->planes[1];
+    ep->flip_ts_monotonic = drmGetCap(ep->drm_fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) == 0 && cap;
+
+    if (getenv("EPLAY_NO_ATOMIC") == NULL &&
+        drmSetClientCap(ep->drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0 &&
+        lookup_plane_props(ep->drm_fd, &ep->ov_plane))
+    {
+        ep->drm_handler = ecore_main_fd_handler_add(ep->drm_fd, ECORE_FD_READ | ECORE_FD_ERROR, handle_drm_event, ep, NULL, NULL);
+        ep->atomic = ep->drm_handler != NULL;
+    }
+
+    printf("kms: using %s modesetting\n", ep->atomic ? "atomic" : "legacy");
+    return true;
+}
+
+void eplay_cleanup_kms(struct eplay* ep)
+{
+    if (ep->drm_handler)
+        ecore_main_fd_handler_del(ep->drm_handler);
+    ep->drm_handler = NULL;
+}
@@ -24,32 +24,8 @@
 
 #include "eplay.h"
 
+#include <pthread.h>
 
-static void set_stereo(GstBin* bin)
-{
-    GstIterator* iter = gst_bin_iterate_recurse(bin);
-    gpointer elem;
-
-    while (GST_ITERATOR_OK == gst_iterator_next(iter, &elem))
-    {
-        GstElementFactory *factory = gst_element_get_factory(GST_ELEMENT(elem));
-        if (factory)
-        {
-            gchar* name = NULL;
-            g_object_get(factory, "name", &name, NULL);
-            if (name && strcmp(name, "a52dec") == 0)
-            {
-                //g_object_set(elem, "lfe", true, NULL);
-                g_object_set(elem, "drc", true, NULL);
-                g_object_set(elem, "mode", 2, NULL);
-                printf("%s: setting mode=2\n", name);
-                g_free(name);
-            }
-        }
-
-        g_object_unref(elem);
-    }
-}
 
 void eplay_switch_audio(struct eplay* ep)
 {
@@ -65,41 +41,412 @@ void eplay_switch_audio(struct eplay* ep)
     }
 }
 
-void eplay_play(struct eplay* ep, const char* file)
+static const char* s_request_names[PLAY_REQUEST_COUNT] = {
+    [PLAY_OPEN] = "open",
+    [PLAY_START] = "play",
+    [PLAY_PAUSE] = "pause",
+    [PLAY_SEEK] = "seek",
+};
+
+enum request_result
 {
-    gchar *uri;
-    GstFormat format = GST_FORMAT_TIME;
+    REQUEST_DONE,
+    REQUEST_PENDING,
+    REQUEST_FAILED
+};
 
-    printf("playing '%s'\n", file);
+/* bus message forwarded from a streaming thread to the main loop */
+struct bus_event
+{
+    struct eplay* ep;
+    GstElement* bin; /* pipeline that posted it, referenced */
+    GstMessageType type;
+    GstState state;
+    unsigned int generation; /* of the open it belongs to */
+};
 
-    uri = gst_filename_to_uri(file, NULL);
+/* owned by each playbin, its streaming threads get here without looking at ep->playbin */
+struct pipeline_data
+{
+    struct eplay* ep;
+    int on_screen; /* atomic, set while it is ep->playbin */
+    struct tune_counters tune;
+};
 
-    gst_element_set_state(ep->playbin, GST_STATE_NULL);
-    if (gst_element_get_state(ep->playbin, NULL, NULL, GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS)
+// the next file is handed to the streaming thread that runs out of data
+static pthread_mutex_t s_next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_request(struct play_request* req)
+{
+    free(req->file);
+    free(req);
+}
+
+static void queue_request(struct eplay* ep, enum play_request_type type, const char* file, gint64 position)
+{
+    struct play_request* req = calloc(1, sizeof(*req));
+
+    req->type = type;
+    req->file = file ? strdup(file) : NULL;
+    req->position = position;
+    req->rate = ep->play_rate;
+    ep->play_queue = eina_list_append(ep->play_queue, req);
+}
+
+// drops queued requests of the given type, or all of them for PLAY_REQUEST_COUNT
+static void drop_requests(struct eplay* ep, enum play_request_type type)
+{
+    Eina_List *l = ep->play_queue, *next;
+
+    while (l)
     {
+        struct play_request* req = eina_list_data_get(l);
+        next = eina_list_next(l);
+
+        if (type == PLAY_REQUEST_COUNT || req->type == type)
+        {
+            free_request(req);
+            ep->play_queue = eina_list_remove_list(ep->play_queue, l);
+        }
+        l = next;
+    }
+}
+
+static enum request_result state_result(GstStateChangeReturn ret)
+{
+    if (ret == GST_STATE_CHANGE_FAILURE)
+        return REQUEST_FAILED;
+    return ret == GST_STATE_CHANGE_ASYNC ? REQUEST_PENDING : REQUEST_DONE;
+}
+
+static void index_entry_added(GstIndex* index, GstIndexEntry* entry, gpointer data)
+{
+    struct eplay* ep = data;
+    gint64 time = -1, offset = -1;
+    int i;
+
+    if (entry->type != GST_INDEX_ENTRY_ASSOCIATION ||
+        !(GST_INDEX_ASSOC_FLAGS(entry) & GST_ASSOCIATION_FLAG_KEY_UNIT))
+        return;
+
+    for (i = 0; i < GST_INDEX_NASSOCS(entry); ++i)
+    {
+        if (GST_INDEX_ASSOC_FORMAT(entry, i) == GST_FORMAT_TIME)
+            time = GST_INDEX_ASSOC_VALUE(entry, i);
+        else if (GST_INDEX_ASSOC_FORMAT(entry, i) == GST_FORMAT_BYTES)
+            offset = GST_INDEX_ASSOC_VALUE(entry, i);
+    }
+
+    if (time >= 0 && offset >= 0)
+        eplay_index_add(&ep->key_index, time, offset);
+}
+
+static void new_gst_index(struct eplay* ep)
+{
+    if (ep->gst_index)
+        gst_object_unref(ep->gst_index);
+
+    ep->gst_index = gst_index_factory_make("memindex");
+    if (ep->gst_index)
+        g_signal_connect(ep->gst_index, "entry-added", G_CALLBACK(index_entry_added), ep);
+}
+
+// hands the cached key frames to a demuxer so it can seek without scanning
+static void preload_index(struct eplay* ep, GstElement* element)
+{
+    const struct key_index* idx = &ep->key_index;
+    gint id;
+    uint32_t i;
+
+    if (!idx->count || !gst_index_get_writer_id(ep->gst_index, GST_OBJECT(element), &id))
+        return;
+
+    for (i = 0; i < idx->count; ++i)
+        gst_index_add_association(ep->gst_index, id, GST_ASSOCIATION_FLAG_KEY_UNIT,
+                                  GST_FORMAT_TIME, idx->entries[i].time,
+                                  GST_FORMAT_BYTES, idx->entries[i].offset, NULL);
+}
+
+static struct pipeline_data* pipeline_data(GstElement* playbin)
+{
+    return g_object_get_data(G_OBJECT(playbin), "eplay");
+}
+
+// data is the pipeline_data of the playbin the bin belongs to
+static void element_added(GstBin* bin, GstElement* element, gpointer data)
+{
+    struct pipeline_data* pd = data;
+    struct eplay* ep = pd->ep;
+
+    // playbin plugs its elements into nested bins, follow them all
+    if (GST_IS_BIN(element))
+        g_signal_connect(element, "element-added", G_CALLBACK(element_added), pd);
+
+    // also while prerolling in the background, settings must be in place before the first buffer
+    eplay_tune_element(&pd->tune, element);
+
+    // index and queue sizes belong to the file on screen, see adopt_bin
+    if (!__atomic_load_n(&pd->on_screen, __ATOMIC_ACQUIRE))
+        return;
+
+    eplay_readahead_element(ep, element);
+
+    if (ep->gst_index && gst_element_is_indexable(element))
+    {
+        gst_element_set_index(element, ep->gst_index);
+        preload_index(ep, element);
+    }
+}
+
+static gboolean do_seek(struct eplay* ep, gint64 position, double rate)
+{
+    GstSeekFlags flags = (GstSeekFlags) (GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_FLUSH);
+
+    if (rate == 1.0)
+        return gst_element_seek_simple(ep->playbin, GST_FORMAT_TIME, flags, position);
+
+    // trick modes only show key frames, the decoders may skip everything else
+    flags = (GstSeekFlags) (flags | GST_SEEK_FLAG_SKIP);
+    if (rate > 0)
+        return gst_element_seek(ep->playbin, rate, GST_FORMAT_TIME, flags,
+                                GST_SEEK_TYPE_SET, position, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+
+    // rewind plays the segment from its end towards the start
+    return gst_element_seek(ep->playbin, rate, GST_FORMAT_TIME, flags,
+                            GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_SET, position);
+}
+
+static enum request_result start_request(struct eplay* ep, struct play_request* req)
+{
+    switch (req->type)
+    {
+    case PLAY_OPEN:
+    {
+        const struct media_info* info = eplay_metadata_get(ep, req->file);
+        gchar *uri;
+
+        printf("playing '%s'\n", req->file);
+        // known from the metadata workers, saves a query once the file is open
+        ep->duration = info ? info->duration : 0;
+        // going to NULL never prerolls, it only waits for the streaming threads to stop
+        if (gst_element_set_state(ep->playbin, GST_STATE_NULL) == GST_STATE_CHANGE_FAILURE)
+            return REQUEST_FAILED;
+        // the way down to NULL has posted PAUSED on the way, that is not the new file prerolled
+        __atomic_add_fetch(&ep->play_generation, 1, __ATOMIC_RELEASE);
+
+        // nothing writes into the old index anymore
+        eplay_index_close(&ep->key_index);
+        eplay_index_open(&ep->key_index, req->file);
+        new_gst_index(ep);
+        // sizes the queues before decodebin gets plugged
+        eplay_readahead_start(ep, req->file);
+
+        uri = gst_filename_to_uri(req->file, NULL);
         g_object_set(ep->playbin, "uri", uri, NULL);
+        g_free(uri);
+        return state_result(gst_element_set_state(ep->playbin, GST_STATE_PAUSED));
+    }
+    case PLAY_START:
+        return state_result(gst_element_set_state(ep->playbin, GST_STATE_PLAYING));
+    case PLAY_PAUSE:
+        return state_result(gst_element_set_state(ep->playbin, GST_STATE_PAUSED));
+    case PLAY_SEEK:
+        // a flushing seek loses the preroll, ASYNC_DONE tells when the new position is ready
+        if (!do_seek(ep, req->position, req->rate))
+            return REQUEST_FAILED;
+        return REQUEST_PENDING;
+    default:
+        return REQUEST_FAILED;
+    }
+}
+
+static void record_transition(struct transition_stats* st, uint64_t elapsed)
+{
+    st->count++;
+    st->total += elapsed;
+    st->last = elapsed;
+    if (elapsed > st->max)
+        st->max = elapsed;
+}
 
-        gst_element_set_state(ep->playbin, GST_STATE_PAUSED);
+static void drop_next(struct eplay* ep)
+{
+    pthread_mutex_lock(&s_next_lock);
+    g_free(ep->next_uri);
+    ep->next_uri = NULL;
+    pthread_mutex_unlock(&s_next_lock);
 
-        if (gst_element_get_state(ep->playbin, NULL, NULL, GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS)
-            set_stereo(GST_BIN(ep->playbin));
+    if (ep->next_bin)
+    {
+        gst_element_set_state(ep->next_bin, GST_STATE_NULL);
+        gst_object_unref(ep->next_bin);
+        ep->next_bin = NULL;
+    }
+    free(ep->next_file);
+    ep->next_file = NULL;
+    ep->next_ready = false;
+}
+
+static GstElement* create_playbin(struct eplay* ep, bool background);
+static void track_changed(void *data);
+
+// gets the item after the current one going while it plays
+static void prepare_next(struct eplay* ep)
+{
+    const char* next = eplay_next_file(ep, ep->current_file);
+    gint nvideo = 0;
 
-        gst_element_set_state(ep->playbin, GST_STATE_PLAYING);
-        if (gst_element_get_state(ep->playbin, NULL, NULL, GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS)
+    drop_next(ep);
+    if (!next)
+        return;
+
+    ep->next_file = strdup(next);
+    g_object_get(ep->playbin, "n-video", &nvideo, NULL);
+
+    if (nvideo == 0)
+    {
+        // audio continues gaplessly in the same pipeline, see about_to_finish
+        pthread_mutex_lock(&s_next_lock);
+        ep->next_uri = gst_filename_to_uri(next, NULL);
+        pthread_mutex_unlock(&s_next_lock);
+        return;
+    }
+
+    ep->next_bin = create_playbin(ep, true);
+    if (ep->next_bin)
+    {
+        gchar* uri = gst_filename_to_uri(next, NULL);
+
+        g_object_set(ep->next_bin, "uri", uri, NULL);
+        g_free(uri);
+        ep->next_started = eplay_time_us();
+        if (gst_element_set_state(ep->next_bin, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE)
         {
-            if (!gst_element_query_duration(ep->playbin, &format, &ep->duration))
-            {
-                ep->duration = 0;
-                printf("failed to query duration\n");
-            }
-            else
-            {
-                printf("duration: %llu\n", ep->duration);
-            }
+            gst_element_set_state(ep->next_bin, GST_STATE_NULL);
+            gst_object_unref(ep->next_bin);
+            ep->next_bin = NULL;
         }
     }
-    
-    g_free(uri);
+}
+
+// streaming thread: the current file is almost done
+static void about_to_finish(GstElement* playbin, gpointer data)
+{
+    struct eplay* ep = data;
+    bool queued = false;
+
+    pthread_mutex_lock(&s_next_lock);
+    if (ep->next_uri)
+    {
+        g_object_set(playbin, "uri", ep->next_uri, NULL);
+        g_free(ep->next_uri);
+        ep->next_uri = NULL;
+        queued = true;
+    }
+    pthread_mutex_unlock(&s_next_lock);
+
+    if (queued)
+        ecore_main_loop_thread_safe_call_async(track_changed, ep);
+}
+
+static void start_timing_first_frame(struct eplay* ep, bool prerolled)
+{
+    ep->ttff_started = eplay_time_us();
+    ep->ttff_prerolled = prerolled;
+    ep->ttff_pending = true;
+}
+
+static void playing(struct eplay* ep)
+{
+    uint64_t elapsed = eplay_time_us() - ep->ttff_started;
+
+    if (!ep->ttff_pending)
+        return;
+
+    ep->ttff_pending = false;
+    record_transition(&ep->ttff_stats[ep->ttff_prerolled], elapsed);
+    printf("first frame after %.1f ms (%s)\n", elapsed / 1000.0, ep->ttff_prerolled ? "prerolled" : "cold");
+}
+
+static void finish_request(struct eplay* ep, struct play_request* req, bool ok)
+{
+    struct transition_stats* st = &ep->play_stats[req->type];
+    uint64_t elapsed = eplay_time_us() - ep->play_started;
+    GstFormat format = GST_FORMAT_TIME;
+
+    if (!ok)
+    {
+        printf("%s failed after %.1f ms\n", s_request_names[req->type], elapsed / 1000.0);
+    }
+    else
+    {
+        record_transition(st, elapsed);
+        printf("%s: %.1f ms\n", s_request_names[req->type], elapsed / 1000.0);
+    }
+
+    if (req->type == PLAY_SEEK && req->position == ep->seek_target)
+        ep->seek_target = -1;
+
+    if (ok && req->type == PLAY_SEEK)
+        ep->pos_rate = req->rate;
+    else if (ok && req->type == PLAY_OPEN)
+        ep->pos_rate = 1.0;
+    ep->pos_valid = false;
+
+    if (ok && req->type == PLAY_OPEN)
+    {
+        eplay_tuning_opened(ep, ep->playbin, &pipeline_data(ep->playbin)->tune);
+        if (ep->duration)
+        {
+            printf("duration: %llu (cached)\n", ep->duration);
+        }
+        else if (!gst_element_query_duration(ep->playbin, &format, &ep->duration))
+        {
+            ep->duration = 0;
+            printf("failed to query duration\n");
+        }
+        else
+        {
+            printf("duration: %llu\n", ep->duration);
+        }
+        prepare_next(ep);
+    }
+
+    free_request(req);
+}
+
+static void run_queue(struct eplay* ep)
+{
+    while (!ep->play_active && ep->play_queue)
+    {
+        struct play_request* req = eina_list_data_get(ep->play_queue);
+        enum request_result res;
+
+        ep->play_queue = eina_list_remove_list(ep->play_queue, ep->play_queue);
+        ep->play_started = eplay_time_us();
+
+        res = start_request(ep, req);
+        if (res == REQUEST_PENDING)
+            ep->play_active = req;
+        else
+            finish_request(ep, req, res == REQUEST_DONE);
+    }
+}
+
+static void complete_active(struct eplay* ep, bool ok)
+{
+    struct play_request* req = ep->play_active;
+
+    ep->play_active = NULL;
+    finish_request(ep, req, ok);
+
+    // whatever was queued behind a failed request no longer makes sense
+    if (!ok)
+    {
+        drop_requests(ep, PLAY_REQUEST_COUNT);
+        ep->play_target = ep->play_state;
+    }
+    run_queue(ep);
 }
 
 static void stopped(void *data)
@@ -109,14 +456,239 @@ static void stopped(void *data)
     printf("Stopped\n");
 }
 
+// the scanner's figure if it has one, otherwise whatever the pipeline knows by now
+static void update_duration(struct eplay* ep)
+{
+    GstFormat format = GST_FORMAT_TIME;
+    const struct media_info* info = eplay_metadata_get(ep, ep->current_file);
+
+    ep->duration = info ? info->duration : 0;
+    if (!ep->duration && !gst_element_query_duration(ep->playbin, &format, &ep->duration))
+        ep->duration = 0;
+}
+
+static void handle_next_event(struct eplay* ep, struct bus_event* ev)
+{
+    if (ev->type == GST_MESSAGE_ASYNC_DONE && !ep->next_ready)
+    {
+        ep->next_ready = true;
+        printf("next: '%s' prerolled in %.1f ms\n", ep->next_file,
+               (eplay_time_us() - ep->next_started) / 1000.0);
+    }
+    else if (ev->type == GST_MESSAGE_ERROR)
+    {
+        // it can still be started cold
+        gst_element_set_state(ep->next_bin, GST_STATE_NULL);
+        gst_object_unref(ep->next_bin);
+        ep->next_bin = NULL;
+    }
+}
+
+static void handle_bus_event(void *data)
+{
+    struct bus_event* ev = data;
+    struct eplay* ep = ev->ep;
+    struct play_request* req = ep->play_active;
+
+    if (ev->bin == ep->next_bin)
+        handle_next_event(ep, ev);
+    else if (ev->bin == ep->playbin && ev->generation == ep->play_generation)
+    {
+        // state changes and finished seeks move the stream under the clock
+        ep->pos_valid = false;
+
+        switch (ev->type)
+        {
+        case GST_MESSAGE_STATE_CHANGED:
+            ep->play_state = ev->state;
+            if (ev->state == GST_STATE_PLAYING)
+                playing(ep);
+            if (req && req->type != PLAY_SEEK &&
+                ev->state == (req->type == PLAY_START ? GST_STATE_PLAYING : GST_STATE_PAUSED))
+                complete_active(ep, true);
+            break;
+        case GST_MESSAGE_ASYNC_DONE:
+            if (req && req->type == PLAY_SEEK)
+                complete_active(ep, true);
+            break;
+        case GST_MESSAGE_ERROR:
+            if (req)
+                complete_active(ep, false);
+            break;
+        case GST_MESSAGE_DURATION:
+            // after a gapless switch the query still answered for the previous file
+            update_duration(ep);
+            break;
+        case GST_MESSAGE_EOS:
+            if (ep->next_file)
+                eplay_play(ep, ep->next_file);
+            else
+                stopped(ep);
+            break;
+        default:
+            break;
+        }
+    }
+
+    gst_object_unref(ev->bin);
+    free(ev);
+}
+
+static void post_bus_event(struct eplay* ep, GstElement* bin, GstMessageType type, GstState state)
+{
+    struct bus_event* ev = malloc(sizeof(*ev));
+
+    ev->ep = ep;
+    ev->bin = gst_object_ref(bin);
+    ev->type = type;
+    ev->state = state;
+    ev->generation = __atomic_load_n(&ep->play_generation, __ATOMIC_ACQUIRE);
+    ecore_main_loop_thread_safe_call_async(handle_bus_event, ev);
+}
+
+// index and queue sizes follow the pipeline that is on screen
+static void adopt_bin(struct eplay* ep, GstBin* bin)
+{
+    GstIterator* iter = gst_bin_iterate_recurse(bin);
+    gpointer elem;
+
+    while (GST_ITERATOR_OK == gst_iterator_next(iter, &elem))
+    {
+        eplay_readahead_element(ep, GST_ELEMENT(elem));
+        if (ep->gst_index && gst_element_is_indexable(GST_ELEMENT(elem)))
+            gst_element_set_index(GST_ELEMENT(elem), ep->gst_index);
+        g_object_unref(elem);
+    }
+    gst_iterator_free(iter);
+}
+
+static void swap_next(struct eplay* ep)
+{
+    GstElement* old = ep->playbin;
+    GstElement* sink = NULL;
+
+    printf("playing '%s' (prerolled)\n", ep->next_file);
+
+    // what it posted while prerolling is in the past now, like an open
+    __atomic_add_fetch(&ep->play_generation, 1, __ATOMIC_RELEASE);
+    // elements added from now on are set up by element_added, the ones before by adopt_bin
+    __atomic_store_n(&pipeline_data(old)->on_screen, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&pipeline_data(ep->next_bin)->on_screen, 1, __ATOMIC_RELEASE);
+    ep->playbin = ep->next_bin;
+    ep->next_bin = NULL;
+    ep->play_state = GST_STATE_PAUSED;
+    ep->pos_valid = false;
+    ep->pos_rate = 1.0;
+
+    gst_element_set_state(old, GST_STATE_NULL);
+    gst_object_unref(old);
+
+    free(ep->current_file);
+    ep->current_file = ep->next_file;
+    ep->next_file = NULL;
+    ep->next_ready = false;
+
+    g_object_get(ep->playbin, "video-sink", &sink, NULL);
+    if (sink)
+    {
+        if (ep->kmssink)
+            g_object_set(sink, "show-preroll-frame", TRUE, NULL);
+        else
+            eplay_video_sink_show(sink);
+        gst_object_unref(sink);
+    }
+
+    eplay_index_close(&ep->key_index);
+    eplay_index_open(&ep->key_index, ep->current_file);
+    new_gst_index(ep);
+    eplay_readahead_start(ep, ep->current_file);
+    adopt_bin(ep, GST_BIN(ep->playbin));
+    eplay_tuning_opened(ep, ep->playbin, &pipeline_data(ep->playbin)->tune);
+    update_duration(ep);
+
+    prepare_next(ep);
+}
+
+// main loop: the pipeline moved on to the next file without stopping
+static void track_changed(void *data)
+{
+    struct eplay* ep = data;
+
+    printf("playing '%s' (gapless)\n", ep->next_file);
+
+    free(ep->current_file);
+    ep->current_file = ep->next_file;
+    ep->next_file = NULL;
+    ep->pos_valid = false;
+
+    // the new demuxer picks up the fresh index in element_added
+    eplay_index_close(&ep->key_index);
+    eplay_index_open(&ep->key_index, ep->current_file);
+    new_gst_index(ep);
+    eplay_readahead_start(ep, ep->current_file);
+    update_duration(ep);
+
+    prepare_next(ep);
+}
+
+void eplay_play(struct eplay* ep, const char* file)
+{
+    bool prerolled = ep->next_bin && ep->next_file && strcmp(ep->next_file, file) == 0;
+
+    // a new file makes everything pending obsolete, including a preroll in progress
+    drop_requests(ep, PLAY_REQUEST_COUNT);
+    if (ep->play_active)
+    {
+        printf("%s cancelled\n", s_request_names[ep->play_active->type]);
+        free_request(ep->play_active);
+        ep->play_active = NULL;
+    }
+
+    if (ep->seek_timer)
+        ecore_timer_del(ep->seek_timer);
+    ep->seek_timer = NULL;
+    ep->seek_target = -1;
+    ep->play_rate = 1.0;
+
+    start_timing_first_frame(ep, prerolled);
+
+    if (prerolled)
+    {
+        swap_next(ep);
+    }
+    else
+    {
+        // file may be next_file itself
+        char* name = strdup(file);
+
+        drop_next(ep);
+        free(ep->current_file);
+        ep->current_file = name;
+        queue_request(ep, PLAY_OPEN, name, 0);
+    }
+
+    queue_request(ep, PLAY_START, NULL, 0);
+    ep->play_target = GST_STATE_PLAYING;
+
+    run_queue(ep);
+}
+
+void eplay_play_next(struct eplay* ep)
+{
+    if (ep->next_file)
+        eplay_play(ep, ep->next_file);
+}
+
 static GstBusSyncReply bus_call(GstBus * bus, GstMessage * msg, gpointer data)
 {
-    struct eplay* ep = (struct eplay*) data;
+    GstElement* bin = data;
+    struct pipeline_data* pd = pipeline_data(bin);
+    struct eplay* ep = pd->ep;
 
     switch (GST_MESSAGE_TYPE(msg)) {
         case GST_MESSAGE_EOS:
             printf("End-of-stream\n");
-            ecore_main_loop_thread_safe_call_async(stopped, ep);
+            post_bus_event(ep, bin, GST_MESSAGE_EOS, GST_STATE_VOID_PENDING);
             break;
         case GST_MESSAGE_ERROR:
         {
@@ -129,8 +701,33 @@ static GstBusSyncReply bus_call(GstBus * bus, GstMessage * msg, gpointer data)
             printf("Error: %s\n", err->message);
             g_error_free(err);
 
+            post_bus_event(ep, bin, GST_MESSAGE_ERROR, GST_STATE_VOID_PENDING);
             break;
         }
+        case GST_MESSAGE_STATE_CHANGED:
+            if (GST_MESSAGE_SRC(msg) == GST_OBJECT(bin))
+            {
+                GstState state;
+                gst_message_parse_state_changed(msg, NULL, &state, NULL);
+                post_bus_event(ep, bin, GST_MESSAGE_STATE_CHANGED, state);
+            }
+            break;
+        case GST_MESSAGE_ASYNC_DONE:
+            if (GST_MESSAGE_SRC(msg) == GST_OBJECT(bin))
+                post_bus_event(ep, bin, GST_MESSAGE_ASYNC_DONE, GST_STATE_VOID_PENDING);
+            break;
+        case GST_MESSAGE_DURATION:
+            post_bus_event(ep, bin, GST_MESSAGE_DURATION, GST_STATE_VOID_PENDING);
+            break;
+        case GST_MESSAGE_BUFFERING:
+            // only shown on the OSD, playback goes on while the queues refill
+            if (__atomic_load_n(&pd->on_screen, __ATOMIC_ACQUIRE))
+            {
+                gint percent = 0;
+                gst_message_parse_buffering(msg, &percent);
+                __atomic_store_n(&ep->ra_level, percent, __ATOMIC_RELAXED);
+            }
+            break;
         default:
             //printf("type: %i\n", GST_MESSAGE_TYPE(msg));
             break;
@@ -141,109 +738,295 @@ static GstBusSyncReply bus_call(GstBus * bus, GstMessage * msg, gpointer data)
     return GST_BUS_DROP;
 }
 
-static gint64 get_position(struct eplay* ep)
+// one real query, after that the position follows the pipeline clock
+static void sync_position(struct eplay* ep)
 {
+    GstFormat format = GST_FORMAT_TIME;
     gint64 value = 0;
-    GstFormat format = GST_FORMAT_TIME;   
-    if (!gst_element_query_position(ep->playbin, &format, &value))
+
+    if (ep->pos_clock)
+        gst_object_unref(ep->pos_clock);
+    ep->pos_clock = NULL;
+
+    if (gst_element_query_position(ep->playbin, &format, &value))
     {
-        printf("failed to query position\n");
+        ep->pos_clock = gst_element_get_clock(ep->playbin);
+        if (ep->pos_clock)
+            ep->pos_clock_time = gst_clock_get_time(ep->pos_clock);
     }
+
+    // a failed query is retried on the next resync, not on every call
+    ep->pos_value = value;
+    ep->pos_synced = eplay_time_us();
+    ep->pos_valid = true;
+    ep->pos_queries++;
+}
+
+static gint64 get_position(struct eplay* ep)
+{
+    gint64 value;
+
+    if (!ep->pos_valid || eplay_time_us() - ep->pos_synced > EPLAY_POSITION_RESYNC)
+        sync_position(ep);
+
+    value = ep->pos_value;
+    if (ep->play_state == GST_STATE_PLAYING && ep->pos_clock)
+        value += (gint64)((gint64)(gst_clock_get_time(ep->pos_clock) - ep->pos_clock_time) * ep->pos_rate);
+
+    if (value < 0)
+        value = 0;
+    if (ep->duration && value > ep->duration)
+        value = ep->duration;
+
+    ep->pos_estimates++;
     return value;
 }
 
 
+static Eina_Bool seek_settled(void *data)
+{
+    struct eplay* ep = data;
+    gint64 value = ep->seek_target >= 0 ? ep->seek_target : get_position(ep);
+
+    ep->seek_timer = NULL;
+
+    drop_requests(ep, PLAY_SEEK);
+    queue_request(ep, PLAY_SEEK, NULL, value);
+    run_queue(ep);
+
+    return ECORE_CALLBACK_CANCEL;
+}
+
+// a burst of key presses turns into a single seek once it settles
+static void schedule_seek(struct eplay* ep)
+{
+    if (ep->seek_timer)
+        ecore_timer_del(ep->seek_timer);
+    ep->seek_timer = ecore_timer_add(EPLAY_SEEK_SETTLE, seek_settled, ep);
+}
+
+static Eina_Bool readahead_tick(void *data)
+{
+    struct eplay* ep = data;
+
+    if (ep->current_file && ep->play_state >= GST_STATE_PAUSED)
+        eplay_readahead_update(ep, get_position(ep));
+    return ECORE_CALLBACK_RENEW;
+}
+
 double eplay_seek(struct eplay* ep, int offset)
 {
-    
-    double progress = 0.0;
+    struct key_entry key;
+    gint64 value;
 
-    gst_element_set_state(ep->playbin, GST_STATE_PAUSED);
-    if (gst_element_get_state(ep->playbin, NULL, NULL, GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS)
-    {
-        GstFormat format = GST_FORMAT_TIME;
-        gint64 value = get_position(ep);
-        if (ep->duration)
-        {
-            progress = (double)value / ep->duration;
-        }
-        printf("pos: %llu, %f\n", value, progress);
+    // seeks pile up relative to the last requested position, not the one on screen
+    value = ep->seek_target >= 0 ? ep->seek_target : get_position(ep);
+    value += GST_SECOND * offset;
+    if (value < 0)
+        value = 0;
+    if (ep->duration && value > ep->duration)
+        value = ep->duration;
 
-        if (gst_element_seek_simple(ep->playbin, format, (GstSeekFlags) (GST_SEEK_FLAG_SEGMENT | GST_SEEK_FLAG_KEY_UNIT | GST_SEEK_FLAG_FLUSH), value + GST_SECOND * offset))
-        {
-            printf("failed to seek\n");
-        }
+    // land on the key frame the demuxer will pick, so the OSD shows where playback resumes
+    if (eplay_index_lookup(&ep->key_index, value, offset > 0, &key))
+        value = key.time;
+
+    ep->seek_target = value;
+    schedule_seek(ep);
+
+    return ep->duration ? (double)value / ep->duration : 0.0;
+}
+
+double eplay_trick(struct eplay* ep, int direction)
+{
+    double rate = ep->play_rate;
 
-        //gst_element_set_state(ep->playbin, GST_STATE_PLAYING);
+    // 1x, 2x .. 32x forward, -2x .. -32x rewind, each press one step
+    if (direction == 0)
+        rate = 1.0;
+    else if (direction > 0)
+        rate = rate == -2.0 ? 1.0 : rate < 0 ? rate / 2 : rate < 32.0 ? rate * 2 : rate;
+    else
+        rate = rate == 1.0 ? -2.0 : rate > 1.0 ? rate / 2 : rate > -32.0 ? rate * 2 : rate;
 
-        // seek_event = gst_event_new_seek (1.0, GST_FORMAT_TIME,
-//                 (GstSeekFlags) (GST_SEEK_FLAG_SEGMENT | GST_SEEK_FLAG_FLUSH),
-//                 GST_SEEK_TYPE_SET, start_time,
-//                 GST_SEEK_TYPE_NONE, stop_time);
+    if (rate != ep->play_rate)
+    {
+        printf("rate: %gx\n", rate);
+        ep->play_rate = rate;
+        schedule_seek(ep);
     }
-    return progress;
+
+    if (ep->play_target != GST_STATE_PLAYING)
+        eplay_set_playing(ep, true);
+
+    return rate;
 }
 
-bool eplay_is_playing(struct eplay* ep)
+double eplay_get_rate(struct eplay* ep)
 {
-    GstState state = GST_STATE_NULL;
-    if (!gst_element_get_state(ep->playbin, &state, NULL, GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS)
-        printf("failed to get state\n");
+    return ep->play_rate;
+}
 
-    return state == GST_STATE_PLAYING;
+bool eplay_is_playing(struct eplay* ep)
+{
+    return ep->play_target == GST_STATE_PLAYING;
 }
 
 
 void eplay_set_playing(struct eplay* ep, bool playing)
 {
-    if (!gst_element_set_state(ep->playbin, playing ? GST_STATE_PLAYING : GST_STATE_PAUSED))
-        printf("failed to set state\n");
+    drop_requests(ep, PLAY_START);
+    drop_requests(ep, PLAY_PAUSE);
+    queue_request(ep, playing ? PLAY_START : PLAY_PAUSE, NULL, 0);
+    ep->play_target = playing ? GST_STATE_PLAYING : GST_STATE_PAUSED;
+    run_queue(ep);
 }
 
 double eplay_get_progress(struct eplay* ep)
 {
     double progress = 0.0;
-    gint64 value = get_position(ep);
+    gint64 value = ep->seek_target >= 0 ? ep->seek_target : get_position(ep);
     if (ep->duration)
         progress = (double)value / ep->duration;
     return progress;
 }
 
-bool eplay_setup_gstreamer(struct eplay* ep)
+void eplay_player_report(struct eplay* ep)
 {
-    GstBus *bus;
-    GstElement *kmssink;
+    static const char* ttff_names[2] = { "cold", "prerolled" };
+    int i;
 
-    gst_init(NULL, NULL);
+    printf("player: %u position queries for %u position reads\n", ep->pos_queries, ep->pos_estimates);
 
-    ep->playbin = gst_element_factory_make("playbin2", NULL);
-    if (!ep->playbin) {
+    for (i = 0; i < 2; ++i)
+    {
+        const struct transition_stats* st = &ep->ttff_stats[i];
+        if (st->count)
+            printf("player: first frame %-9s %u times, avg %.1f ms, max %.1f ms, last %.1f ms\n", ttff_names[i],
+                   st->count, st->total / 1000.0 / st->count, st->max / 1000.0, st->last / 1000.0);
+    }
+
+    for (i = 0; i < PLAY_REQUEST_COUNT; ++i)
+    {
+        const struct transition_stats* st = &ep->play_stats[i];
+        if (st->count)
+            printf("player: %-5s %u times, avg %.1f ms, max %.1f ms, last %.1f ms\n", s_request_names[i],
+                   st->count, st->total / 1000.0 / st->count, st->max / 1000.0, st->last / 1000.0);
+    }
+}
+
+static GstElement* create_playbin(struct eplay* ep, bool background)
+{
+    struct pipeline_data* pd;
+    GstBus *bus;
+    GstElement *playbin, *videosink = NULL;
+
+    playbin = gst_element_factory_make("playbin2", NULL);
+    if (!playbin) {
         printf("'playbin2' gstreamer plugin missing\n");
-        return false;
+        return NULL;
     }
 
-    kmssink = gst_element_factory_make("kmssink", NULL);
-    if (!kmssink) {
-        printf("'kmssink' gstreamer plugin missing\n");
-        return false;
+    if (ep->headless)
+    {
+        // no screen and no sound card, the sinks still keep to the clock
+        GstElement* audiosink = gst_element_factory_make("fakesink", NULL);
+
+        videosink = gst_element_factory_make("fakesink", NULL);
+        if (!videosink || !audiosink) {
+            printf("'fakesink' gstreamer plugin missing\n");
+            if (videosink)
+                gst_object_unref(videosink);
+            if (audiosink)
+                gst_object_unref(audiosink);
+            gst_object_unref(playbin);
+            return NULL;
+        }
+        g_object_set(videosink, "sync", TRUE, NULL);
+        g_object_set(audiosink, "sync", TRUE, "signal-handoffs", TRUE, NULL);
+        g_object_set(playbin, "audio-sink", audiosink, NULL);
+    }
+    // frames go straight into our own scanout buffers unless kmssink is forced
+    else if (getenv("EPLAY_KMSSINK") == NULL)
+        videosink = eplay_create_video_sink(ep, background);
+
+    if (!videosink) {
+        videosink = gst_element_factory_make("kmssink", NULL);
+        if (!videosink) {
+            printf("'kmssink' gstreamer plugin missing\n");
+            gst_object_unref(playbin);
+            return NULL;
+        }
+
+        g_object_set(videosink, "scale", 1, NULL);
+        g_object_set(videosink, "crtc-id", ep->crtc, NULL);
+        g_object_set(videosink, "plane-id", ep->planes[0], NULL);
+        // a pipeline prerolling in the background must not take over the screen
+        g_object_set(videosink, "show-preroll-frame", !background, NULL);
+        ep->kmssink = true;
     }
 
-    g_object_set(ep->playbin, "video-sink", kmssink, NULL);
-    g_object_set(kmssink, "scale", 1, NULL);
-    g_object_set(kmssink, "crtc-id", ep->crtc, NULL);
-    g_object_set(kmssink, "plane-id", ep->planes[0], NULL);
+    pd = calloc(1, sizeof(*pd));
+    pd->ep = ep;
+    pd->on_screen = !background;
+
+    g_object_set(playbin, "video-sink", videosink, NULL);
+    g_object_set_data_full(G_OBJECT(playbin), "eplay", pd, free);
+    g_signal_connect(playbin, "about-to-finish", G_CALLBACK(about_to_finish), ep);
+    g_signal_connect(playbin, "element-added", G_CALLBACK(element_added), pd);
 
-    bus = gst_element_get_bus(ep->playbin);
-    gst_bus_set_sync_handler(bus, bus_call, ep);
+    bus = gst_element_get_bus(playbin);
+    gst_bus_set_sync_handler(bus, bus_call, playbin);
     g_object_unref(bus);
 
+    return playbin;
+}
+
+bool eplay_setup_gstreamer(struct eplay* ep)
+{
+    gst_init(NULL, NULL);
+
+    ep->playbin = create_playbin(ep, false);
+    if (!ep->playbin)
+        return false;
+
+    ep->play_state = ep->play_target = GST_STATE_NULL;
+    ep->seek_target = -1;
+    ep->play_rate = 1.0;
+    ep->pos_rate = 1.0;
+    ep->ra_timer = ecore_timer_add(1.0, readahead_tick, ep);
+
     //ecore_main_loop_glib_integrate();
     return true;
 }
 
 void eplay_cleanup_gstreamer(struct eplay *ep)
 {
+    if (ep->ra_timer)
+        ecore_timer_del(ep->ra_timer);
+    ep->ra_timer = NULL;
+    if (ep->seek_timer)
+        ecore_timer_del(ep->seek_timer);
+    ep->seek_timer = NULL;
+
+    drop_requests(ep, PLAY_REQUEST_COUNT);
+    if (ep->play_active)
+        free_request(ep->play_active);
+    ep->play_active = NULL;
+
+    drop_next(ep);
+    free(ep->current_file);
+    ep->current_file = NULL;
+    if (ep->pos_clock)
+        gst_object_unref(ep->pos_clock);
+    ep->pos_clock = NULL;
+
     gst_element_set_state(ep->playbin, GST_STATE_NULL);
     g_object_unref(ep->playbin);
+    eplay_cleanup_video(ep);
+    eplay_index_close(&ep->key_index);
+    if (ep->gst_index)
+        gst_object_unref(ep->gst_index);
+    ep->gst_index = NULL;
     gst_deinit();
 }
@@ -0,0 +1,711 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define CANCEL_CHECK 256 /* entries read between checks for a newer scan */
+#define DIRENT_BUFFER (64 * 1024) /* bytes per getdents64 call, a few hundred entries */
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+#define REFRESH_DELAY 0.5 /* s to let a burst of changes settle */
+
+/* listing handed from the worker to the main loop */
+struct listing_result
+{
+    struct eplay* ep;
+    unsigned int generation;
+    struct dir_listing* listing;
+};
+
+/* record returned by getdents64, the libc does not declare it */
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/* entry being read, size -1 until it is known */
+struct raw_entry
+{
+    uint32_t offset; /* of the name in the arena */
+    unsigned char type;
+    long long size;
+};
+
+/* what has been read so far, names and entries in growing arrays */
+struct raw_listing
+{
+    char* names;
+    size_t used, size;
+    struct raw_entry* entries;
+    unsigned int count, alloc;
+};
+
+// protects the pending request and the quit flag
+static pthread_mutex_t s_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_list_cond = PTHREAD_COND_INITIALIZER;
+
+static void free_listing(struct dir_listing* listing)
+{
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->types);
+    free(listing->sizes);
+    free(listing->path);
+    free(listing);
+}
+
+struct dir_listing* eplay_listing_ref(struct dir_listing* listing)
+{
+    __atomic_add_fetch(&listing->refs, 1, __ATOMIC_RELAXED);
+    return listing;
+}
+
+// the worker holds a reference while it fills in the sizes
+void eplay_listing_unref(struct dir_listing* listing)
+{
+    if (listing && __atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free_listing(listing);
+}
+
+const char* eplay_listing_name(const struct dir_listing* listing, unsigned int i)
+{
+    return listing->names + listing->offsets[i];
+}
+
+bool eplay_listing_path(const struct dir_listing* listing, unsigned int i, char* path, size_t len)
+{
+    return (size_t)snprintf(path, len, "%s/%s", listing->path, eplay_listing_name(listing, i)) < len;
+}
+
+long long eplay_listing_size(const struct dir_listing* listing, unsigned int i)
+{
+    return __atomic_load_n(&listing->sizes[i], __ATOMIC_RELAXED);
+}
+
+static bool cancelled(struct eplay* ep, unsigned int generation)
+{
+    return __atomic_load_n(&ep->list_generation, __ATOMIC_RELAXED) != generation;
+}
+
+static bool add_entry(struct raw_listing* raw, const char* name, unsigned char type)
+{
+    size_t len = strlen(name) + 1;
+
+    if (raw->used + len > raw->size)
+    {
+        size_t size = raw->size ? raw->size * 2 : 16 * 1024;
+        char* n;
+
+        while (raw->used + len > size)
+            size *= 2;
+        // offsets are 32 bit, four billion bytes of names are not a directory anyone browses
+        if (size > UINT32_MAX || !(n = realloc(raw->names, size)))
+            return false;
+        raw->names = n;
+        raw->size = size;
+    }
+    if (raw->count == raw->alloc)
+    {
+        unsigned int alloc = raw->alloc ? raw->alloc * 2 : 256;
+        struct raw_entry* e = realloc(raw->entries, alloc * sizeof(*e));
+        if (!e)
+            return false;
+        raw->entries = e;
+        raw->alloc = alloc;
+    }
+
+    memcpy(raw->names + raw->used, name, len);
+    raw->entries[raw->count].offset = raw->used;
+    raw->entries[raw->count].type = type;
+    raw->entries[raw->count].size = -1;
+    raw->count++;
+    raw->used += len;
+    return true;
+}
+
+// worker: the entries the file system could not type, symbolic links among them, with one stat each
+static bool resolve_types(struct eplay* ep, unsigned int generation, int dfd, struct raw_listing* raw)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < raw->count; ++i)
+    {
+        struct raw_entry* e = &raw->entries[i];
+        struct stat st;
+
+        if (e->type != DT_UNKNOWN && e->type != DT_LNK)
+            continue;
+        if (++n % CANCEL_CHECK == 0 && cancelled(ep, generation))
+            return false;
+
+        // a dangling link stays a link, shown as a file
+        if (fstatat(dfd, raw->names + e->offset, &st, 0) != 0)
+            continue;
+        e->type = IFTODT(st.st_mode);
+        if (!S_ISDIR(st.st_mode))
+            e->size = st.st_size;
+    }
+    return true;
+}
+
+// worker: copies the entries part refers to into the listing from start on, in sort order
+static bool sort_part(struct dir_listing* listing, unsigned int start, const struct raw_listing* raw,
+                      const unsigned int* part, unsigned int count, enum eplay_sort_mode mode)
+{
+    const char** names = malloc((count + 1) * sizeof(*names));
+    unsigned int* order;
+    unsigned int i;
+
+    if (!names)
+        return false;
+    for (i = 0; i < count; ++i)
+        names[i] = raw->names + raw->entries[part[i]].offset;
+    order = eplay_sort_order(names, count, 0, mode);
+    free(names);
+    if (!order)
+        return false;
+
+    for (i = 0; i < count; ++i)
+    {
+        const struct raw_entry* e = &raw->entries[part[order[i]]];
+
+        listing->offsets[start + i] = e->offset;
+        listing->types[start + i] = e->type;
+        listing->sizes[start + i] = e->size;
+    }
+    free(order);
+    return true;
+}
+
+// worker: NULL if the directory cannot be read or a newer scan came in
+static struct dir_listing* read_listing(struct eplay* ep, const char* path, unsigned int generation)
+{
+    struct raw_listing raw = { NULL };
+    struct dir_listing* listing = NULL;
+    unsigned int* parts = NULL;
+    struct stat st;
+    char* dents;
+    unsigned int dirs = 0, files, i;
+    size_t path_len = strlen(path);
+    long len = 1;
+    int dfd;
+
+    dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0)
+    {
+        fprintf(stderr, "browser: cannot read '%s'\n", path);
+        return NULL;
+    }
+    // taken before reading, a change while reading makes the next check fail
+    if (fstat(dfd, &st) != 0)
+        memset(&st, 0, sizeof(st));
+
+    // readdir() fetches 32 kB at a time, fewer and larger calls help on slow media
+    dents = malloc(DIRENT_BUFFER);
+    while (dents && (len = syscall(SYS_getdents64, dfd, dents, DIRENT_BUFFER)) > 0)
+    {
+        long pos;
+
+        for (pos = 0; pos < len; pos += ((struct linux_dirent64*)(dents + pos))->d_reclen)
+        {
+            const struct linux_dirent64* ent = (const struct linux_dirent64*)(dents + pos);
+
+            if (ent->d_name[0] == '.')
+                continue;
+            if (!add_entry(&raw, ent->d_name, ent->d_type))
+            {
+                len = -1;
+                break;
+            }
+        }
+        if (len < 0 || cancelled(ep, generation))
+            break;
+    }
+
+    if (len != 0 || cancelled(ep, generation) || !resolve_types(ep, generation, dfd, &raw))
+    {
+        if (len < 0 && dents)
+            fprintf(stderr, "browser: cannot read '%s'\n", path);
+        goto out;
+    }
+
+    // directories first, each part sorted on its own
+    parts = malloc((raw.count + 1) * sizeof(*parts));
+    if (!parts)
+        goto out;
+    for (i = 0; i < raw.count; ++i)
+        if (raw.entries[i].type == DT_DIR)
+            parts[dirs++] = i;
+    files = dirs;
+    for (i = 0; i < raw.count; ++i)
+        if (raw.entries[i].type != DT_DIR)
+            parts[files++] = i;
+
+    listing = calloc(1, sizeof(*listing));
+    if (!listing)
+        goto out;
+    listing->path = strdup(path);
+    listing->count = raw.count;
+    listing->offsets = malloc((raw.count + 1) * sizeof(*listing->offsets));
+    listing->types = malloc(raw.count + 1);
+    listing->sizes = malloc((raw.count + 1) * sizeof(*listing->sizes));
+    if (!listing->path || !listing->offsets || !listing->types || !listing->sizes ||
+        !sort_part(listing, 0, &raw, parts, dirs, ep->list_sort) ||
+        !sort_part(listing, dirs, &raw, parts + dirs, raw.count - dirs, ep->list_sort))
+    {
+        free_listing(listing);
+        listing = NULL;
+        goto out;
+    }
+
+    // the listing takes over the names, trimmed to what they need
+    listing->names = realloc(raw.names, raw.used + 1);
+    if (!listing->names)
+        listing->names = raw.names;
+    raw.names = NULL;
+    listing->path_len = path_len;
+    listing->dirs = dirs;
+    listing->refs = 1;
+    listing->wd = -1;
+    listing->mtime = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    listing->bytes = sizeof(*listing) + path_len + 1 + raw.used + listing->count *
+                     (sizeof(*listing->offsets) + sizeof(*listing->types) + sizeof(*listing->sizes));
+    // a shared string of each full path with eina's bookkeeping, a pointer and a size
+    listing->shared_bytes = sizeof(*listing) + path_len + 1 + listing->count *
+                            (path_len + 1 + EPLAY_STRINGSHARE_OVERHEAD + sizeof(char*) + sizeof(*listing->sizes)) + raw.used;
+
+out:
+    close(dfd);
+    free(dents);
+    free(parts);
+    free(raw.names);
+    free(raw.entries);
+    return listing;
+}
+
+static void sized(void* data);
+
+// worker: sizes of the files not stat()ed for their type, while the listing is on screen already
+static bool fill_sizes(struct eplay* ep, struct dir_listing* listing, unsigned int generation)
+{
+    unsigned int i, filled = 0;
+    int dfd = open(listing->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dfd < 0)
+        return false;
+
+    for (i = listing->dirs; i < listing->count; ++i)
+    {
+        struct stat st;
+
+        if ((i - listing->dirs) % CANCEL_CHECK == CANCEL_CHECK - 1 && cancelled(ep, generation))
+            break;
+        if (listing->sizes[i] >= 0)
+            continue;
+        if (fstatat(dfd, eplay_listing_name(listing, i), &st, 0) == 0)
+        {
+            __atomic_store_n(&listing->sizes[i], (long long)st.st_size, __ATOMIC_RELAXED);
+            filled++;
+        }
+    }
+    close(dfd);
+
+    // a pass cut short is picked up again when the listing is shown from the cache
+    if (i == listing->count)
+        __atomic_store_n(&listing->sized, 1, __ATOMIC_RELEASE);
+    return filled > 0;
+}
+
+// worker: takes over the reference to listing, the browser updates if any size came in
+static void size_listing(struct eplay* ep, struct dir_listing* listing, unsigned int generation)
+{
+    struct listing_result* r = malloc(sizeof(*r));
+
+    if (r && fill_sizes(ep, listing, generation))
+    {
+        r->ep = ep;
+        r->generation = generation;
+        r->listing = listing;
+        ecore_main_loop_thread_safe_call_async(sized, r);
+    }
+    else
+    {
+        eplay_listing_unref(listing);
+        free(r);
+    }
+}
+
+static void drop_cached(struct eplay* ep, struct dir_listing* listing)
+{
+    eina_hash_del_by_key(ep->list_cache, listing->path);
+    if (listing->wd >= 0)
+    {
+        eina_hash_del_by_key(ep->list_watches, &listing->wd);
+        inotify_rm_watch(ep->list_inotify, listing->wd);
+    }
+    ep->list_lru = eina_inlist_remove(ep->list_lru, EINA_INLIST_GET(listing));
+    ep->list_bytes -= listing->bytes;
+    eplay_listing_unref(listing);
+}
+
+static Eina_Bool refresh_cb(void *data);
+
+static void cache_listing(struct eplay* ep, struct dir_listing* listing)
+{
+    struct dir_listing* old = eina_hash_find(ep->list_cache, listing->path);
+    struct stat st;
+
+    if (old)
+        drop_cached(ep, old);
+
+    // without inotify, e.g. on some fuse file systems, the directory mtime is checked on every visit
+    if (ep->list_inotify >= 0)
+        listing->wd = inotify_add_watch(ep->list_inotify, listing->path, WATCH_EVENTS);
+    if (listing->wd >= 0)
+    {
+        // another path to the same directory gets the same watch, its listing hands it over
+        struct dir_listing* other = eina_hash_find(ep->list_watches, &listing->wd);
+        if (other)
+        {
+            eina_hash_del_by_key(ep->list_watches, &other->wd);
+            other->wd = -1;
+            drop_cached(ep, other);
+        }
+        eina_hash_add(ep->list_watches, &listing->wd, listing);
+    }
+
+    eina_hash_add(ep->list_cache, listing->path, eplay_listing_ref(listing));
+    ep->list_lru = eina_inlist_append(ep->list_lru, EINA_INLIST_GET(listing));
+    ep->list_bytes += listing->bytes;
+
+    while (ep->list_bytes > EPLAY_LIST_BUDGET && ep->list_lru != EINA_INLIST_GET(listing))
+    {
+        ep->list_evicted++;
+        drop_cached(ep, EINA_INLIST_CONTAINER_GET(ep->list_lru, struct dir_listing));
+    }
+
+    // the watch only exists from now on, a change while the worker was reading had no event;
+    // the mtime was taken before reading, handled like an event that came in right away
+    if (listing->wd >= 0 && listing->mtime && stat(listing->path, &st) == 0 &&
+        (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec != listing->mtime)
+    {
+        ep->list_invalidated++;
+        if (strcmp(listing->path, ep->current_path) == 0 && !ep->list_refresh)
+            ep->list_refresh = ecore_timer_add(REFRESH_DELAY, refresh_cb, ep);
+        drop_cached(ep, listing);
+    }
+}
+
+// main loop
+static void finished(void* data)
+{
+    struct listing_result* r = data;
+    struct eplay* ep = r->ep;
+
+    // posted just before the worker was stopped
+    if (!ep->list_running)
+    {
+        eplay_listing_unref(r->listing);
+        free(r);
+        return;
+    }
+
+    // also when the user has moved on, going back is likely
+    cache_listing(ep, r->listing);
+    if (r->generation == ep->list_generation)
+        eplay_browser_show(ep, r->listing);
+    else
+        eplay_listing_unref(r->listing);
+    free(r);
+}
+
+// main loop
+static void sized(void* data)
+{
+    struct listing_result* r = data;
+    struct eplay* ep = r->ep;
+
+    if (ep->list_running && eina_hash_find(ep->list_cache, r->listing->path) == r->listing &&
+        strcmp(r->listing->path, ep->current_path) == 0)
+        eplay_browser_update(ep);
+    eplay_listing_unref(r->listing);
+    free(r);
+}
+
+static Eina_Bool refresh_cb(void *data)
+{
+    struct eplay* ep = data;
+
+    ep->list_refresh = NULL;
+    eplay_listing_scan(ep, ep->current_path);
+    return ECORE_CALLBACK_CANCEL;
+}
+
+static Eina_Bool inotify_cb(void *data, Ecore_Fd_Handler *handler)
+{
+    struct eplay* ep = data;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len, i;
+
+    while ((len = read(ep->list_inotify, buf, sizeof(buf))) > 0)
+    {
+        for (i = 0; i < len; i += sizeof(struct inotify_event) + ((struct inotify_event*)(buf + i))->len)
+        {
+            const struct inotify_event* ev = (const struct inotify_event*)(buf + i);
+            struct dir_listing* listing = eina_hash_find(ep->list_watches, &ev->wd);
+
+            // events were lost, nothing cached can be trusted
+            if (ev->mask & IN_Q_OVERFLOW)
+            {
+                eplay_listing_invalidate(ep);
+                if (!ep->list_refresh)
+                    ep->list_refresh = ecore_timer_add(REFRESH_DELAY, refresh_cb, ep);
+                continue;
+            }
+            if (!listing)
+                continue;
+
+            ep->list_invalidated++;
+            if (strcmp(listing->path, ep->current_path) == 0 && !ep->list_refresh)
+                ep->list_refresh = ecore_timer_add(REFRESH_DELAY, refresh_cb, ep);
+            // the kernel has already dropped the watch
+            if (ev->mask & IN_IGNORED)
+            {
+                eina_hash_del_by_key(ep->list_watches, &listing->wd);
+                listing->wd = -1;
+            }
+            drop_cached(ep, listing);
+        }
+    }
+    return ECORE_CALLBACK_RENEW;
+}
+
+void eplay_listing_invalidate(struct eplay* ep)
+{
+    while (ep->list_lru)
+        drop_cached(ep, EINA_INLIST_CONTAINER_GET(ep->list_lru, struct dir_listing));
+}
+
+static void* worker(void* data)
+{
+    struct eplay* ep = data;
+
+    pthread_mutex_lock(&s_list_lock);
+    while (!ep->list_quit)
+    {
+        char* path = ep->list_request;
+        unsigned int generation = ep->list_request_generation;
+        long long mtime = ep->list_request_mtime;
+        struct dir_listing* unsized = ep->list_request_unsized;
+        struct listing_result* r;
+        struct stat st;
+        uint64_t start;
+
+        if (!path)
+        {
+            pthread_cond_wait(&s_list_cond, &s_list_lock);
+            continue;
+        }
+        ep->list_request = NULL;
+        ep->list_request_unsized = NULL;
+        pthread_mutex_unlock(&s_list_lock);
+
+        // the cached listing on screen is still right, only its sizes may be missing
+        if (mtime && stat(path, &st) == 0 &&
+            (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec == mtime)
+        {
+            if (unsized)
+                size_listing(ep, unsized, generation);
+            free(path);
+            pthread_mutex_lock(&s_list_lock);
+            continue;
+        }
+        eplay_listing_unref(unsized);
+
+        start = eplay_time_us();
+        r = malloc(sizeof(*r));
+        if (r && (r->listing = read_listing(ep, path, generation)))
+        {
+            struct dir_listing* listing = eplay_listing_ref(r->listing);
+
+            printf("browser: %u entries in '%s' read in %.1f ms\n", listing->count, path,
+                   (eplay_time_us() - start) / 1000.0);
+            r->ep = ep;
+            r->generation = generation;
+            ecore_main_loop_thread_safe_call_async(finished, r);
+            size_listing(ep, listing, generation);
+        }
+        else
+        {
+            free(r);
+        }
+        free(path);
+
+        pthread_mutex_lock(&s_list_lock);
+    }
+    pthread_mutex_unlock(&s_list_lock);
+    return NULL;
+}
+
+void eplay_listing_scan(struct eplay* ep, const char* path)
+{
+    struct dir_listing* listing = eina_hash_find(ep->list_cache, path);
+    unsigned int generation = __atomic_add_fetch(&ep->list_generation, 1, __ATOMIC_RELAXED);
+    long long mtime = 0;
+
+    if (listing)
+    {
+        ep->list_hits++;
+        ep->list_lru = eina_inlist_demote(ep->list_lru, EINA_INLIST_GET(listing));
+        eplay_browser_show(ep, eplay_listing_ref(listing));
+        mtime = listing->mtime;
+    }
+    else
+    {
+        ep->list_misses++;
+    }
+
+    // a scan still running for the previous directory notices and gives up
+    pthread_mutex_lock(&s_list_lock);
+    free(ep->list_request);
+    ep->list_request = NULL;
+    eplay_listing_unref(ep->list_request_unsized);
+    ep->list_request_unsized = NULL;
+    // a watched listing is up to date, a request still waiting for another directory goes;
+    // one left before its size pass was done still needs the rest of it
+    if (!listing || listing->wd < 0 || !__atomic_load_n(&listing->sized, __ATOMIC_ACQUIRE))
+    {
+        ep->list_request = strdup(path);
+        ep->list_request_generation = generation;
+        ep->list_request_mtime = mtime;
+        if (listing && !__atomic_load_n(&listing->sized, __ATOMIC_ACQUIRE))
+            ep->list_request_unsized = eplay_listing_ref(listing);
+        pthread_cond_signal(&s_list_cond);
+    }
+    pthread_mutex_unlock(&s_list_lock);
+}
+
+void eplay_listing_report(struct eplay* ep)
+{
+    const struct dir_listing* listing;
+    size_t entries = 0, shared = 0;
+
+    printf("browser: %d listings cached in %zu kB, %u hits, %u misses, %u invalidated, %u evicted\n",
+           eina_hash_population(ep->list_cache), ep->list_bytes / 1024, ep->list_hits,
+           ep->list_misses, ep->list_invalidated, ep->list_evicted);
+
+    EINA_INLIST_FOREACH(ep->list_lru, listing)
+    {
+        entries += listing->count;
+        shared += listing->shared_bytes;
+    }
+    if (entries)
+        printf("browser: %zu entries, %.1f bytes each, %.1f as shared full paths\n", entries,
+               (double)ep->list_bytes / entries, (double)shared / entries);
+
+    // the genlist keeps an item per entry on top, only realized rows have objects
+    if (ep->list_shown)
+        printf("browser: %u of %u entries in the list\n", elm_genlist_items_count(ep->win), ep->list_shown->count);
+}
+
+bool eplay_setup_listing(struct eplay* ep)
+{
+    eina_threads_init();
+
+    ep->list_inotify = -1;
+    ep->list_cache = eina_hash_string_superfast_new(NULL);
+    ep->list_watches = eina_hash_int32_new(NULL);
+    if (!ep->list_cache || !ep->list_watches)
+        return false;
+
+    ep->list_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ep->list_inotify >= 0)
+        ep->list_inotify_handler = ecore_main_fd_handler_add(ep->list_inotify, ECORE_FD_READ, inotify_cb, ep, NULL, NULL);
+    else
+        perror("browser: inotify_init1");
+    if (!ep->list_inotify_handler && ep->list_inotify >= 0)
+    {
+        close(ep->list_inotify);
+        ep->list_inotify = -1;
+    }
+
+    if (pthread_create(&ep->list_worker, NULL, worker, ep) != 0)
+    {
+        perror("browser: pthread_create");
+        return false;
+    }
+    ep->list_running = true;
+    return true;
+}
+
+void eplay_cleanup_listing(struct eplay* ep)
+{
+    pthread_mutex_lock(&s_list_lock);
+    ep->list_quit = true;
+    __atomic_add_fetch(&ep->list_generation, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&s_list_cond);
+    pthread_mutex_unlock(&s_list_lock);
+
+    if (ep->list_running)
+        pthread_join(ep->list_worker, NULL);
+    ep->list_running = false;
+
+    free(ep->list_request);
+    ep->list_request = NULL;
+    eplay_listing_unref(ep->list_request_unsized);
+    ep->list_request_unsized = NULL;
+
+    if (ep->list_refresh)
+        ecore_timer_del(ep->list_refresh);
+    ep->list_refresh = NULL;
+    if (ep->list_cache)
+        eplay_listing_invalidate(ep);
+    if (ep->list_inotify_handler)
+    {
+        ecore_main_fd_handler_del(ep->list_inotify_handler);
+        close(ep->list_inotify);
+    }
+    ep->list_inotify_handler = NULL;
+    ep->list_inotify = -1;
+    if (ep->list_cache)
+        eina_hash_free(ep->list_cache);
+    ep->list_cache = NULL;
+    if (ep->list_watches)
+        eina_hash_free(ep->list_watches);
+    ep->list_watches = NULL;
+    eina_threads_shutdown();
+}
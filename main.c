@@ -32,6 +32,7 @@
 
 #include "eplay.h"
 
+#include <getopt.h>
 #include <unistd.h>
 #include <sys/reboot.h>
 
@@ -41,16 +42,35 @@ EAPI_MAIN int elm_main(int argc, char **argv);
 
 static struct eplay g_player;
 
+static void*
+new_update_region(int x, int y, int w, int h, int *row_bytes)
+{
+    return eplay_overlay_region_new(&g_player, x, y, w, h, row_bytes);
+}
+
+static void
+free_update_region(int x, int y, int w, int h, void *data)
+{
+    eplay_overlay_region_done(&g_player, x, y, w, h);
+}
+
+static void
+render_pre(void *data, Evas *e, void *event_info)
+{
+    struct eplay* ep = data;
+    ep->render_start = eplay_time_us();
+}
+
 static void
 setup_elm(struct eplay* ep)
 {
     Evas* e;
     Evas_Engine_Info_Buffer *einfo;
-    int w = ep->overlay[0].width;
-    int h = ep->overlay[0].height;
+    int w = ep->overlay[0].buf.width;
+    int h = ep->overlay[0].buf.height;
 
     elm_config_engine_set("ews");
-    elm_config_scale_set(2.0);
+    elm_config_scale_set(2.0 / ep->ov_scale);
     ecore_evas_ews_engine_set("buffer", NULL);
     ecore_evas_ews_setup(0, 0, w, h);
     // printf("%s:%i\n", __FUNCTION__, __LINE__);
@@ -62,21 +82,115 @@ setup_elm(struct eplay* ep)
 
     einfo = (Evas_Engine_Info_Buffer *)evas_engine_info_get(e);
     einfo->info.depth_type = EVAS_ENGINE_BUFFER_DEPTH_ARGB32;
-    einfo->info.dest_buffer = ep->overlay[0].data;
+    // no dest buffer: the engine renders updates into its own images and
+    // hands them out region by region, which gives us the damage
+    einfo->info.dest_buffer = NULL;
     einfo->info.dest_buffer_row_bytes = w * 4;
     einfo->info.use_color_key = 0;
     einfo->info.alpha_threshold = 0;
-    einfo->info.func.new_update_region = NULL;
-    einfo->info.func.free_update_region = NULL;
+    einfo->info.func.new_update_region = new_update_region;
+    einfo->info.func.free_update_region = free_update_region;
     einfo->info.func.switch_buffer = eplay_switch_overlay_buffer;
     einfo->info.switch_data = ep;
     evas_engine_info_set(e, (Evas_Engine_Info *)einfo);
+    evas_event_callback_add(e, EVAS_CALLBACK_RENDER_PRE, render_pre, ep);
 
     ecore_evas_alpha_set(ecore_evas_ews_ecore_evas_get(), EINA_TRUE);
 }
 
+static void
+usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [options]\n"
+        "  -b, --overlay-buffers=N   number of OSD buffers (2-4, default 2)\n"
+        "  -s, --osd-scale=N         render the OSD at 1/N resolution (1-3, default 1)\n"
+        "  -f, --osd-format=FORMAT   argb8888 (default), argb4444, argb1555 or rgb565\n"
+        "  -d, --device=PATH         use a generic KMS device with dumb buffers instead of omapdrm\n"
+        "  -S, --sort=MODE           browser order: natural (default), collate or bytes\n",
+        name);
+}
+
+static bool
+parse_args(struct eplay* ep, int argc, char **argv)
+{
+    static const struct option options[] = {
+        { "overlay-buffers", required_argument, NULL, 'b' },
+        { "osd-scale", required_argument, NULL, 's' },
+        { "osd-format", required_argument, NULL, 'f' },
+        { "device", required_argument, NULL, 'd' },
+        { "sort", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+
+    ep->ov_count = 2;
+    ep->ov_scale = 1;
+    ep->ov_format = eplay_pixel_format_find("argb8888");
+
+    while ((c = getopt_long(argc, argv, "b:s:f:d:S:", options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            ep->ov_count = atoi(optarg);
+            if (ep->ov_count < 2 || ep->ov_count > EPLAY_MAX_OV_BUFFERS)
+            {
+                fprintf(stderr, "overlay buffers must be between 2 and %i\n", EPLAY_MAX_OV_BUFFERS);
+                return false;
+            }
+            break;
+        case 's':
+            ep->ov_scale = atoi(optarg);
+            if (ep->ov_scale < 1 || ep->ov_scale > 3)
+            {
+                fprintf(stderr, "osd scale must be 1, 2 or 3\n");
+                return false;
+            }
+            break;
+        case 'f':
+            ep->ov_format = eplay_pixel_format_find(optarg);
+            if (!ep->ov_format)
+            {
+                fprintf(stderr, "unknown osd format '%s'\n", optarg);
+                return false;
+            }
+            break;
+        case 'd':
+            ep->drm_device = optarg;
+            break;
+        case 'S':
+            if (!eplay_sort_mode_find(optarg, &ep->list_sort))
+            {
+                fprintf(stderr, "unknown sort mode '%s'\n", optarg);
+                return false;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool s_poweroff = false;
 
+static Eina_Bool
+dump_stats(void *data, int type, void *event)
+{
+    struct eplay* ep = data;
+    eplay_kms_report(ep);
+    eplay_timing_report(ep);
+    eplay_video_report(ep);
+    eplay_player_report(ep);
+    eplay_tuning_report(ep);
+    eplay_metadata_report(ep);
+    eplay_thumbnail_report(ep);
+    eplay_readahead_report(ep);
+    eplay_listing_report(ep);
+    return ECORE_CALLBACK_PASS_ON;
+}
+
 void eplay_shutdown(struct eplay* ep)
 {
     s_poweroff = true;
@@ -89,6 +203,9 @@ elm_main(int argc, char **argv)
     // if (! eplay_setup_udev(&g_player))
     //     return 1;
 
+    if (! parse_args(&g_player, argc, argv))
+        return 1;
+
     if (! eplay_setup_input(&g_player))
         return 1;
 
@@ -102,11 +219,22 @@ elm_main(int argc, char **argv)
 
     setup_elm(&g_player);
 
-    if (eplay_setup_mixer(&g_player) && eplay_setup_gui(&g_player) && eplay_setup_gstreamer(&g_player))
+    // kill -USR1 prints the performance counters
+    ecore_event_handler_add(ECORE_EVENT_SIGNAL_USER, dump_stats, &g_player);
+
+    if (eplay_setup_mixer(&g_player) && eplay_setup_listing(&g_player) && eplay_setup_gui(&g_player) &&
+        eplay_setup_gstreamer(&g_player) && eplay_setup_readahead(&g_player) &&
+        eplay_setup_metadata(&g_player) && eplay_setup_thumbnails(&g_player))
     {
         elm_run(); // run main loop
     }
 
+    // the workers post to the main loop, they have to be gone before it shuts down
+    eplay_cleanup_thumbnails(&g_player);
+    eplay_cleanup_metadata(&g_player);
+    eplay_cleanup_readahead(&g_player);
+    eplay_cleanup_listing(&g_player);
+
     elm_shutdown(); // after mainloop finishes running, shutdown
 
     eplay_cleanup_gstreamer(&g_player);
@@ -0,0 +1,418 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <Ecore_File.h>
+#include <gst/pbutils/pbutils.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+#define HASH_ENTRY_OVERHEAD 64 /* bytes of an eina hash node besides key and data, 64 bit */
+
+/* finished file, handed from a worker to the main loop */
+struct media_result
+{
+    struct eplay* ep;
+    const char* path;
+    struct media_info* info; /* NULL if it could not be looked at */
+    bool discovered; /* not from the cache file yet */
+};
+
+// protects the job list and the quit flag
+static pthread_mutex_t s_media_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_media_cond = PTHREAD_COND_INITIALIZER;
+
+static void free_info(void* data)
+{
+    struct media_info* info = data;
+
+    if (!info)
+        return;
+    eina_stringshare_del(info->container);
+    eina_stringshare_del(info->video_codec);
+    eina_stringshare_del(info->audio_codec);
+    free(info);
+}
+
+static Eet_Data_Descriptor* create_descriptor(void)
+{
+    Eet_Data_Descriptor_Class eddc;
+    Eet_Data_Descriptor* edd;
+
+    // stream descriptors hand out stringshares, the same as the workers create
+    EET_EINA_STREAM_DATA_DESCRIPTOR_CLASS_SET(&eddc, struct media_info);
+    edd = eet_data_descriptor_stream_new(&eddc);
+    if (!edd)
+        return NULL;
+
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "size", size, EET_T_LONG_LONG);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "mtime", mtime, EET_T_LONG_LONG);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "duration", duration, EET_T_LONG_LONG);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "container", container, EET_T_STRING);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "video_codec", video_codec, EET_T_STRING);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "audio_codec", audio_codec, EET_T_STRING);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "width", width, EET_T_INT);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "height", height, EET_T_INT);
+    EET_DATA_DESCRIPTOR_ADD_BASIC(edd, struct media_info, "audio_tracks", audio_tracks, EET_T_INT);
+    return edd;
+}
+
+// background threads only run when nothing else wants the cpu or the disk
+void eplay_lower_priority(void)
+{
+    pid_t tid = syscall(SYS_gettid);
+
+    if (setpriority(PRIO_PROCESS, tid, 19) != 0)
+        perror("setpriority");
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+        perror("ioprio_set");
+}
+
+static const char* describe(GstDiscovererStreamInfo* stream)
+{
+    GstCaps* caps = gst_discoverer_stream_info_get_caps(stream);
+    const char* result = NULL;
+
+    if (caps)
+    {
+        gchar* desc = gst_pb_utils_get_codec_description(caps);
+        if (desc)
+            result = eina_stringshare_add(desc);
+        g_free(desc);
+        gst_caps_unref(caps);
+    }
+    return result;
+}
+
+static void discover(GstDiscoverer* dc, const char* path, struct media_info* info)
+{
+    GstDiscovererInfo* di;
+    GstDiscovererStreamInfo* top;
+    GList *video, *audio;
+    gchar* uri;
+
+    uri = gst_filename_to_uri(path, NULL);
+    di = uri ? gst_discoverer_discover_uri(dc, uri, NULL) : NULL;
+    g_free(uri);
+    if (!di)
+        return;
+
+    // anything but media is remembered as such and not looked at again
+    if (gst_discoverer_info_get_result(di) == GST_DISCOVERER_OK)
+    {
+        info->duration = gst_discoverer_info_get_duration(di);
+
+        top = gst_discoverer_info_get_stream_info(di);
+        if (top)
+        {
+            if (GST_IS_DISCOVERER_CONTAINER_INFO(top))
+                info->container = describe(top);
+            gst_discoverer_stream_info_unref(top);
+        }
+
+        video = gst_discoverer_info_get_video_streams(di);
+        if (video)
+        {
+            GstDiscovererVideoInfo* v = video->data;
+            info->video_codec = describe(video->data);
+            info->width = gst_discoverer_video_info_get_width(v);
+            info->height = gst_discoverer_video_info_get_height(v);
+        }
+        gst_discoverer_stream_info_list_free(video);
+
+        audio = gst_discoverer_info_get_audio_streams(di);
+        if (audio)
+            info->audio_codec = describe(audio->data);
+        info->audio_tracks = g_list_length(audio);
+        gst_discoverer_stream_info_list_free(audio);
+    }
+    gst_discoverer_info_unref(di);
+}
+
+static struct media_result* examine(struct eplay* ep, GstDiscoverer* dc, const char* path)
+{
+    struct media_result* r;
+    struct media_info* info;
+    struct stat st;
+
+    // even a file that is gone is reported back, the main loop stops waiting for it
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->ep = ep;
+    r->path = eina_stringshare_ref(path);
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return r;
+
+    info = ep->media_cache ? eet_data_read(ep->media_cache, ep->media_edd, path) : NULL;
+    if (info && (info->size != st.st_size || info->mtime != st.st_mtime))
+    {
+        free_info(info);
+        info = NULL;
+    }
+
+    if (!info && dc && (info = calloc(1, sizeof(*info))))
+    {
+        info->size = st.st_size;
+        info->mtime = st.st_mtime;
+        discover(dc, path, info);
+        r->discovered = true;
+    }
+
+    r->info = info;
+    return r;
+}
+
+// main loop: the only place the workers reach into
+static void finished(void* data)
+{
+    struct media_result* r = data;
+    struct eplay* ep = r->ep;
+
+    // posted just before the workers were stopped
+    if (!ep->media_info)
+    {
+        free_info(r->info);
+        eina_stringshare_del(r->path);
+        free(r);
+        return;
+    }
+
+    eina_hash_del_by_key(ep->media_queued, r->path);
+    if (!r->info)
+    {
+        eina_stringshare_del(r->path);
+        free(r);
+        return;
+    }
+
+    if (r->discovered)
+    {
+        ep->media_discovered++;
+        if (ep->media_cache)
+            eet_data_write(ep->media_cache, ep->media_edd, r->path, r->info, EINA_TRUE);
+    }
+    else
+    {
+        ep->media_cache_hits++;
+    }
+
+    eina_hash_set(ep->media_info, r->path, r->info);
+    eplay_metadata_updated(ep, r->path);
+
+    eina_stringshare_del(r->path);
+    free(r);
+}
+
+static void* worker(void* data)
+{
+    struct eplay* ep = data;
+    GstDiscoverer* dc;
+
+    eplay_lower_priority();
+    dc = gst_discoverer_new(EPLAY_MEDIA_TIMEOUT * GST_SECOND, NULL);
+
+    pthread_mutex_lock(&s_media_lock);
+    while (!ep->media_quit)
+    {
+        const char* path;
+        struct media_result* r;
+
+        if (!ep->media_jobs)
+        {
+            pthread_cond_wait(&s_media_cond, &s_media_lock);
+            continue;
+        }
+
+        path = eina_list_data_get(ep->media_jobs);
+        ep->media_jobs = eina_list_remove_list(ep->media_jobs, ep->media_jobs);
+        pthread_mutex_unlock(&s_media_lock);
+
+        r = examine(ep, dc, path);
+        if (r)
+            ecore_main_loop_thread_safe_call_async(finished, r);
+        eina_stringshare_del(path);
+
+        pthread_mutex_lock(&s_media_lock);
+    }
+    pthread_mutex_unlock(&s_media_lock);
+
+    if (dc)
+        g_object_unref(dc);
+    return NULL;
+}
+
+void eplay_metadata_scan_begin(struct eplay* ep)
+{
+    const char* path;
+
+    // files of the directory left behind are not interesting anymore
+    pthread_mutex_lock(&s_media_lock);
+    EINA_LIST_FREE(ep->media_jobs, path)
+    {
+        if (ep->media_queued)
+            eina_hash_del_by_key(ep->media_queued, path);
+        eina_stringshare_del(path);
+    }
+    pthread_mutex_unlock(&s_media_lock);
+}
+
+// main loop: rows ask for their file when they are realized, and again on every update
+void eplay_metadata_scan(struct eplay* ep, const char* path)
+{
+    if (!ep->media_info || eina_hash_find(ep->media_info, path) || eina_hash_find(ep->media_queued, path))
+        return;
+
+    eina_hash_add(ep->media_queued, path, (void*)1);
+
+    // the rows realized last are the ones on screen now
+    pthread_mutex_lock(&s_media_lock);
+    ep->media_jobs = eina_list_prepend(ep->media_jobs, eina_stringshare_add(path));
+    pthread_cond_signal(&s_media_cond);
+    pthread_mutex_unlock(&s_media_lock);
+}
+
+const struct media_info* eplay_metadata_get(struct eplay* ep, const char* path)
+{
+    if (!ep->media_info || !path)
+        return NULL;
+    return eina_hash_find(ep->media_info, path);
+}
+
+static Eina_Bool
+count_info(const Eina_Hash* hash, const void* key, void* data, void* fdata)
+{
+    size_t* bytes = fdata;
+
+    // the codec names are stringshares, a handful for all files
+    *bytes += strlen(key) + 1 + sizeof(struct media_info) + HASH_ENTRY_OVERHEAD;
+    return EINA_TRUE;
+}
+
+void eplay_metadata_report(struct eplay* ep)
+{
+    size_t known = 0, queued = 0;
+    unsigned int jobs = 0;
+    const char* path;
+    Eina_List* l;
+
+    if (!ep->media_info)
+        return;
+
+    eina_hash_foreach(ep->media_info, count_info, &known);
+
+    pthread_mutex_lock(&s_media_lock);
+    EINA_LIST_FOREACH(ep->media_jobs, l, path)
+    {
+        // the stringshare, the list node and the entry in media_queued
+        queued += strlen(path) + 1 + EPLAY_STRINGSHARE_OVERHEAD + sizeof(Eina_List) +
+                  strlen(path) + 1 + HASH_ENTRY_OVERHEAD;
+        jobs++;
+    }
+    pthread_mutex_unlock(&s_media_lock);
+
+    printf("metadata: %u files discovered, %u from the cache, %u known in %zu kB, %u queued in %zu kB\n",
+           ep->media_discovered, ep->media_cache_hits, eina_hash_population(ep->media_info),
+           known / 1024, jobs, queued / 1024);
+}
+
+bool eplay_setup_metadata(struct eplay* ep)
+{
+    char path[PATH_MAX];
+    int i;
+
+    eina_threads_init();
+    eet_init();
+    gst_pb_utils_init();
+
+    ep->media_info = eina_hash_string_superfast_new(free_info);
+    ep->media_queued = eina_hash_string_superfast_new(NULL);
+    ep->media_edd = create_descriptor();
+    if (!ep->media_info || !ep->media_queued || !ep->media_edd)
+        return false;
+
+    // without a cache everything is discovered again on every start
+    if (eplay_cache_dir(path, sizeof(path), "metadata"))
+    {
+        strncat(path, "/media.eet", sizeof(path) - strlen(path) - 1);
+        ep->media_cache = eet_open(path, EET_FILE_MODE_READ_WRITE);
+    }
+    if (!ep->media_cache)
+        fprintf(stderr, "metadata: no cache file\n");
+
+    for (i = 0; i < EPLAY_MEDIA_WORKERS; ++i)
+    {
+        if (pthread_create(&ep->media_workers[i], NULL, worker, ep) != 0)
+        {
+            perror("metadata: pthread_create");
+            break;
+        }
+        ep->media_worker_count++;
+    }
+    return ep->media_worker_count > 0;
+}
+
+void eplay_cleanup_metadata(struct eplay* ep)
+{
+    int i;
+
+    pthread_mutex_lock(&s_media_lock);
+    ep->media_quit = true;
+    pthread_cond_broadcast(&s_media_cond);
+    pthread_mutex_unlock(&s_media_lock);
+
+    // a worker in the middle of a file finishes it, that is bounded by the discoverer timeout
+    for (i = 0; i < ep->media_worker_count; ++i)
+        pthread_join(ep->media_workers[i], NULL);
+    ep->media_worker_count = 0;
+
+    eplay_metadata_scan_begin(ep);
+    if (!ep->media_info)
+        return;
+
+    if (ep->media_cache)
+        eet_close(ep->media_cache);
+    ep->media_cache = NULL;
+    if (ep->media_edd)
+        eet_data_descriptor_free(ep->media_edd);
+    ep->media_edd = NULL;
+    if (ep->media_info)
+        eina_hash_free(ep->media_info);
+    ep->media_info = NULL;
+    if (ep->media_queued)
+        eina_hash_free(ep->media_queued);
+    ep->media_queued = NULL;
+
+    eet_shutdown();
+    eina_threads_shutdown();
+}
@@ -26,6 +26,7 @@
 #include <libudev.h>
 #include <omap_drmif.h>
 #include <stdint.h>
+#include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 #include <dce.h>
@@ -33,50 +34,298 @@
 #include <poll.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 
+static bool
+alloc_omap_bo(struct eplay* ep, struct drm_buffer* buf, int cpp)
+{
+    buf->bo = omap_bo_new(ep->dev, buf->width * buf->height * cpp, OMAP_BO_WC);
+    if (!buf->bo)
+        return false;
+
+    buf->handle = omap_bo_handle(buf->bo);
+    buf->pitch = buf->width * cpp;
+    buf->size = buf->pitch * buf->height;
+    buf->data = omap_bo_map(buf->bo);
+    return buf->data != NULL;
+}
+
+static bool
+alloc_dumb(struct eplay* ep, struct drm_buffer* buf, int cpp)
+{
+    struct drm_mode_create_dumb create = {
+        .width = buf->width,
+        .height = buf->height,
+        .bpp = cpp * 8,
+    };
+    struct drm_mode_map_dumb map = { 0 };
+    void* data;
+
+    if (drmIoctl(ep->drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+    {
+        fprintf(stderr, "DRM_IOCTL_MODE_CREATE_DUMB failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    buf->handle = create.handle;
+    buf->pitch = create.pitch;
+    buf->size = create.size;
+
+    map.handle = create.handle;
+    if (drmIoctl(ep->drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+    {
+        fprintf(stderr, "DRM_IOCTL_MODE_MAP_DUMB failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    data = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, ep->drm_fd, map.offset);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    buf->data = data;
+    return true;
+}
+
+bool eplay_alloc_drm_buffer(struct eplay* ep, struct drm_buffer* buf, int width, int height, int cpp)
+{
+    buf->width = width;
+    buf->height = height;
+
+    return ep->dev ? alloc_omap_bo(ep, buf, cpp) : alloc_dumb(ep, buf, cpp);
+}
+
 static bool 
-create_drm_buffer(struct omap_device* dev, int fd, struct drm_buffer* buf, uint32_t width, uint32_t height)
+create_drm_buffer(struct eplay* ep, struct drm_buffer* buf, uint32_t width, uint32_t height,
+                  uint32_t fourcc, int cpp)
 {
-    bool result = false;
-    buf->bo = omap_bo_new(dev, width * height * 4, OMAP_BO_WC);
-    if (buf->bo)
+    uint32_t handles[4] = { 0 };
+    uint32_t pitches[4] = { 0 };
+    uint32_t offsets[4] = { 0 };
+
+    if (!eplay_alloc_drm_buffer(ep, buf, width, height, cpp))
+        return false;
+
+    handles[0] = buf->handle;
+    pitches[0] = buf->pitch;
+
+    if (drmModeAddFB2(ep->drm_fd, width, height, fourcc, handles, pitches, offsets, &buf->fb_id, 0))
     {
-        uint32_t fourcc = DRM_FORMAT_ARGB8888;
-        uint32_t handles[4] = { omap_bo_handle(buf->bo) };
-        uint32_t pitches[4] = { width * 4 };
-        uint32_t offsets[4] = { 0 };
-        result = 0 == drmModeAddFB2(fd, width, height, fourcc, handles, pitches, offsets, &buf->fb_id, 0);
-
-        if (! result)
-            fprintf(stderr, "drmModeAddFB2 failed: %s\n", strerror(errno));
-
-        buf->width = width;
-        buf->height = height;
-        buf->data = omap_bo_map(buf->bo);
+        fprintf(stderr, "drmModeAddFB2 failed: %s\n", strerror(errno));
+        return false;
     }
-    return result;
+    return true;
 }
 
-static void
-destroy_drm_buffer(int fd, struct drm_buffer* buf)
+void eplay_destroy_drm_buffer(struct eplay* ep, struct drm_buffer* buf)
 {
+    if (buf->fb_id)
+        drmModeRmFB(ep->drm_fd, buf->fb_id);
+
     if (buf->bo)
     {
         omap_bo_del(buf->bo);
-        drmModeRmFB(fd, buf->fb_id);
     }
+    else if (buf->handle)
+    {
+        struct drm_mode_destroy_dumb destroy = { .handle = buf->handle };
+
+        if (buf->data)
+            munmap(buf->data, buf->size);
+        drmIoctl(ep->drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+
+    memset(buf, 0, sizeof(*buf));
+}
+
+static void
+add_damage(struct damage* d, int x, int y, int w, int h)
+{
+    int i;
+
+    if (d->count == EPLAY_MAX_DAMAGE)
+    {
+        for (i = 1; i < d->count; ++i)
+            eina_rectangle_union(&d->rects[0], &d->rects[i]);
+        d->count = 1;
+    }
+
+    eina_rectangle_coords_from(&d->rects[d->count++], x, y, w, h);
+}
+
+void* eplay_overlay_region_new(struct eplay* ep, int x, int y, int w, int h, int *row_bytes)
+{
+    *row_bytes = ep->ov_shadow_pitch;
+    return (uint8_t*)ep->ov_shadow + y * ep->ov_shadow_pitch + x * 4;
+}
+
+void eplay_overlay_region_done(struct eplay* ep, int x, int y, int w, int h)
+{
+    add_damage(&ep->ov_damage, x, y, w, h);
+}
+
+static bool
+in_flight(struct eplay* ep, const struct ov_buffer* ov)
+{
+    return ep->flip_pending && ep->flip_fb == ov->buf.fb_id;
+}
+
+static int
+find_free_slot(struct eplay* ep)
+{
+    int i;
+    for (i = 0; i < ep->ov_count; ++i)
+        if (ep->overlay[i].state == OV_FREE)
+            return i;
+    return -1;
+}
+
+static int
+acquire_slot(struct eplay* ep)
+{
+    int i = find_free_slot(ep);
+    bool warned = false;
+
+    // every buffer is queued or on screen, only the pending flip can release one;
+    // with two buffers the flip in flight is the frame just queued
+    while (i < 0 && ep->flip_pending)
+    {
+        if (!eplay_kms_wait_flip(ep, 100) && !warned)
+        {
+            fprintf(stderr, "no free overlay buffer, waiting for the page flip\n");
+            warned = true;
+        }
+        i = find_free_slot(ep);
+    }
+
+    // nothing in flight: the latest frame has not gone out and is superseded by the next
+    // switch, a buffer that may be on screen is never handed out
+    if (i < 0)
+        fprintf(stderr, "no free overlay buffer yet\n");
+    return i;
 }
 
 void* eplay_switch_overlay_buffer(void *data, void *dest_buffer)
 {
     struct eplay* ep = data;
-    ep->current_ov_buffer = dest_buffer == ep->overlay[0].data ? 0 : 1;
-    printf("switch %i\n", ep->current_ov_buffer);
+    struct damage* d = &ep->ov_damage;
+    struct ov_buffer* ov;
+    int i, j;
+
+    ep->ov_dirty_pixels = 0;
+    for (i = 0; i < d->count; ++i)
+        ep->ov_dirty_pixels += d->rects[i].w * d->rects[i].h;
+
+    for (i = 0; i < ep->ov_count; ++i)
+    {
+        ov = &ep->overlay[i];
+
+        // an older frame that never reached the screen is superseded
+        if (ov->state == OV_QUEUED && !in_flight(ep, ov))
+            ov->state = OV_FREE;
+
+        for (j = 0; j < d->count; ++j)
+            add_damage(&ov->stale, d->rects[j].x, d->rects[j].y, d->rects[j].w, d->rects[j].h);
+    }
+    d->count = 0;
+
+    // none was free after the last frame, the one superseded above is now
+    if (ep->ov_rendering < 0 && (ep->ov_rendering = acquire_slot(ep)) >= 0)
+        ep->overlay[ep->ov_rendering].state = OV_RENDERING;
+    if (ep->ov_rendering < 0)
+    {
+        // the frame is dropped, its damage stays in the stale regions for the next one
+        fprintf(stderr, "no free overlay buffer, dropping a frame\n");
+        return ep->ov_shadow;
+    }
+
+    ov = &ep->overlay[ep->ov_rendering];
+
+    // Evas renders into cached memory, the frame reaches the scanout buffer only here
+    for (i = 0; i < ov->stale.count; ++i)
+        eplay_convert_rect(ep->ov_format, ov->buf.data, ov->buf.pitch,
+                           ep->ov_shadow, ep->ov_shadow_pitch, &ov->stale.rects[i]);
+    ov->stale.count = 0;
+
+    ov->state = OV_QUEUED;
+    ov->render_start = ep->render_start;
+    ov->switched = eplay_time_us();
+    ov->dirty_pixels = ep->ov_dirty_pixels;
+    ep->ov_latest = ep->ov_rendering;
+
     if (ep->show_overlay)
         eplay_show_overlay(ep);
-    return ep->overlay[ep->current_ov_buffer^1].data;
+
+    ep->ov_rendering = acquire_slot(ep);
+    if (ep->ov_rendering >= 0)
+        ep->overlay[ep->ov_rendering].state = OV_RENDERING;
+
+    return ep->ov_shadow;
+}
+
+static uint32_t
+elapsed(uint64_t from, uint64_t to)
+{
+    return to > from ? to - from : 0;
+}
+
+static void
+record_frame(struct eplay* ep, const struct ov_buffer* ov, uint64_t commit_time, uint64_t flip_time, int missed)
+{
+    struct frame_timing t;
+
+    t.render = ov->render_start ? elapsed(ov->render_start, ov->switched) : 0;
+    t.commit = elapsed(ov->switched, commit_time);
+    t.scanout = elapsed(commit_time, flip_time);
+    // without a vblank counter, guess from how long a commit that normally takes one vblank took
+    t.missed = missed >= 0 ? (uint32_t)missed : ep->frame_time ? t.scanout / ep->frame_time : 0;
+    t.dirty_pixels = ov->dirty_pixels;
+
+    eplay_timing_push(&ep->timing, &t);
+}
+
+// missed is the number of vblanks the flip came late, -1 if the driver could not tell
+void eplay_overlay_flipped(struct eplay* ep, uint32_t fb_id, uint64_t commit_time, uint64_t flip_time, int missed)
+{
+    int i;
+    for (i = 0; i < ep->ov_count; ++i)
+    {
+        struct ov_buffer* ov = &ep->overlay[i];
+
+        if (ov->state == OV_RENDERING)
+            continue;
+
+        if (fb_id && ov->buf.fb_id == fb_id)
+        {
+            // only a new frame counts, not a re-commit for a changed crop
+            if (ov->state == OV_QUEUED)
+                record_frame(ep, ov, commit_time, flip_time, missed);
+            ov->state = OV_SCANOUT;
+        }
+        else if (ov->state == OV_SCANOUT)
+            ov->state = OV_FREE;
+    }
+}
+
+bool eplay_plane_supports_format(int fd, uint32_t plane_id, uint32_t fourcc)
+{
+    drmModePlane *p = drmModeGetPlane(fd, plane_id);
+    bool found = false;
+    uint32_t i;
+
+    if (p)
+    {
+        for (i = 0; i < p->count_formats && !found; ++i)
+            found = p->formats[i] == fourcc;
+        drmModeFreePlane(p);
+    }
+    return found;
 }
 
 static bool
@@ -197,27 +446,49 @@ eplay_setup_drm(struct eplay* ep)
 {
     drmModeRes *resources;
     drmModePlaneRes *plane_resources;
-    drmModeConnector *connector;
+    drmModeConnector *connector = NULL;
     drmModeModeInfo *mode = NULL;
+    Eina_Rectangle all;
+    uint64_t cap = 0;
     int fd;
-    int i;
+    int i, j, w, h;
 
-    wait_for_dce();
+    if (ep->drm_device)
+    {
+        // generic KMS device (e.g. vkms), buffers come from the dumb buffer ioctls
+        ep->drm_fd = fd = open(ep->drm_device, O_RDWR | O_CLOEXEC);
 
-    ep->dev = dce_init();
+        if (fd < 0)
+        {
+            perror(ep->drm_device);
+            return false;
+        }
 
-    if (!ep->dev)
-    {
-        fprintf(stderr, "failed to setup omap_device\n");
-        return false;
+        if (drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &cap) || !cap)
+        {
+            fprintf(stderr, "%s does not support dumb buffers\n", ep->drm_device);
+            return false;
+        }
     }
+    else
+    {
+        wait_for_dce();
 
-    ep->drm_fd = fd = dce_get_fd();
+        ep->dev = dce_init();
 
-    if (fd < 0)
-    {
-        fprintf(stderr, "invalid fd\n");
-        return false;
+        if (!ep->dev)
+        {
+            fprintf(stderr, "failed to setup omap_device\n");
+            return false;
+        }
+
+        ep->drm_fd = fd = dce_get_fd();
+
+        if (fd < 0)
+        {
+            fprintf(stderr, "invalid fd\n");
+            return false;
+        }
     }
 
     resources = drmModeGetResources(fd);
@@ -248,22 +519,32 @@ eplay_setup_drm(struct eplay* ep)
         if (! connector)
             continue;
 
-        encoder = drmModeGetEncoder(fd, connector->encoder_id);
+        // an unlit connector has no current encoder, fall back to the first possible one
+        encoder = drmModeGetEncoder(fd, connector->encoder_id ? connector->encoder_id :
+                                        connector->count_encoders ? connector->encoders[0] : 0);
         if (encoder)
         {
             nplanes = 0;
 
             ep->crtc = encoder->crtc_id;
 
+            for (crtc_index = 0; crtc_index < resources->count_crtcs; ++crtc_index)
+            {
+                if (ep->crtc ? ep->crtc == resources->crtcs[crtc_index] :
+                               (encoder->possible_crtcs & (1 << crtc_index)) != 0)
+                  break;
+            }
+
             drmModeFreeEncoder(encoder);
 
-            for (crtc_index = 0; i < resources->count_crtcs; ++crtc_index)
-                if (ep->crtc == resources->crtcs[crtc_index])
-                  break;
+            if (crtc_index == resources->count_crtcs)
+                crtc_index = 0;
+            ep->crtc = resources->crtcs[crtc_index];
+            ep->crtc_pipe = crtc_index;
 
-            for (i = 0; nplanes < 2 && i < (int)plane_resources->count_planes; i++)
+            for (j = 0; nplanes < 2 && j < (int)plane_resources->count_planes; j++)
             {
-                drmModePlane *p = drmModeGetPlane(fd, plane_resources->planes[i]);
+                drmModePlane *p = drmModeGetPlane(fd, plane_resources->planes[j]);
                 if (p)
                 {
                     fprintf(stderr, "id: %u, fb: %u, possible crtcs: %x\n", p->plane_id, p->fb_id, p->possible_crtcs);
@@ -303,7 +584,7 @@ eplay_setup_drm(struct eplay* ep)
             mode = m;
     }
 
-    if (mode && create_drm_buffer(ep->dev, fd, &ep->bg, mode->hdisplay, mode->vdisplay))
+    if (mode && create_drm_buffer(ep, &ep->bg, mode->hdisplay, mode->vdisplay, DRM_FORMAT_ARGB8888, 4))
     {
         int ret = drmModeSetCrtc(fd, ep->crtc, ep->bg.fb_id, 0, 0, &ep->c_id, 1, mode);
 
@@ -312,47 +593,135 @@ eplay_setup_drm(struct eplay* ep)
             fprintf(stderr, "drmModeSetCrtc failed: %s\n", strerror(errno));
             return false;
         }
+
+        if (mode->vrefresh)
+            ep->frame_time = 1000000 / mode->vrefresh;
     }
 
-    for (i = 0; i < 2; ++i)
-        if (!create_drm_buffer(ep->dev, fd, &ep->overlay[i], mode->hdisplay, mode->vdisplay))
+    if (ep->ov_count < 2 || ep->ov_count > EPLAY_MAX_OV_BUFFERS)
+        ep->ov_count = 2;
+
+    if (ep->ov_scale < 1)
+        ep->ov_scale = 1;
+
+    if (!ep->ov_format)
+        ep->ov_format = eplay_pixel_format_find("argb8888");
+
+    if (!eplay_plane_supports_format(fd, ep->planes[1], ep->ov_format->fourcc))
+    {
+        fprintf(stderr, "overlay plane does not support %s, using argb8888\n", ep->ov_format->name);
+        ep->ov_format = eplay_pixel_format_find("argb8888");
+    }
+
+    w = mode->hdisplay / ep->ov_scale;
+    h = mode->vdisplay / ep->ov_scale;
+
+    // Evas blends against what it rendered before, keep that in cached memory
+    // and only stream finished regions into the write-combined scanout buffers
+    ep->ov_shadow_pitch = w * 4;
+    ep->ov_shadow = calloc(h, ep->ov_shadow_pitch);
+    if (!ep->ov_shadow)
+        return false;
+
+    // the OSD is rendered at a fraction of the mode and stretched by the plane scaler
+    for (i = 0; i < ep->ov_count; ++i)
+    {
+        struct drm_buffer* buf = &ep->overlay[i].buf;
+
+        if (!create_drm_buffer(ep, buf, w, h, ep->ov_format->fourcc, ep->ov_format->cpp))
             return false;
-        
-    return eplay_show_overlay(ep);
+        ep->overlay[i].state = OV_FREE;
+
+        eina_rectangle_coords_from(&all, 0, 0, w, h);
+        eplay_convert_rect(ep->ov_format, buf->data, buf->pitch, ep->ov_shadow, ep->ov_shadow_pitch, &all);
+    }
+
+    if (ep->ov_format->color_key && !eplay_kms_set_color_key(ep, ep->ov_format->color_key))
+        fprintf(stderr, "no colour key support, OSD background will be opaque\n");
+
+    ep->ov_latest = 0;
+    ep->overlay[0].state = OV_QUEUED;
+    ep->ov_rendering = 1;
+    ep->overlay[1].state = OV_RENDERING;
+
+    return eplay_setup_kms(ep) && eplay_show_overlay(ep);
 }
 
 void
 eplay_cleanup_drm(struct eplay* ep)
 {
     int i;
-    for (i = 0; i < 2; ++i)
-        destroy_drm_buffer(ep->drm_fd, &ep->overlay[i]);
 
-    destroy_drm_buffer(ep->drm_fd, &ep->bg);
+    eplay_cleanup_kms(ep);
+
+    for (i = 0; i < ep->ov_count; ++i)
+        eplay_destroy_drm_buffer(ep, &ep->overlay[i].buf);
+
+    eplay_destroy_drm_buffer(ep, &ep->bg);
+
+    free(ep->ov_shadow);
 
-    dce_deinit(ep->dev);
+    if (ep->dev)
+        dce_deinit(ep->dev);
+    else if (ep->drm_fd >= 0)
+        close(ep->drm_fd);
 }
 
 bool eplay_show_overlay(struct eplay* ep)
 {
-    int i = ep->current_ov_buffer;
-    int w = ep->overlay[i].width;
-    int h = ep->overlay[i].height;
+    struct kms_plane* p = &ep->ov_plane;
+    struct drm_buffer* buf = &ep->overlay[ep->ov_latest].buf;
 
-    int ret = drmModeSetPlane(ep->drm_fd, ep->planes[1], ep->crtc, ep->overlay[i].fb_id, 0,
-                    0, 0, w, h, 0 << 16, 0 << 16, w << 16, h << 16);
-    if (ret)
+    p->fb_id = buf->fb_id;
+
+    if (ep->ov_cropped)
     {
-        fprintf(stderr, "drmModeSetPlane failed: %s\n", strerror(errno));
-        return false;
+        p->src_x = ep->ov_crop.x;
+        p->src_y = ep->ov_crop.y;
+        p->src_w = ep->ov_crop.w;
+        p->src_h = ep->ov_crop.h;
+        p->crtc_x = p->src_x * ep->ov_scale;
+        p->crtc_y = p->src_y * ep->ov_scale;
+        p->crtc_w = p->src_w * ep->ov_scale;
+        p->crtc_h = p->src_h * ep->ov_scale;
     }
+    else
+    {
+        p->src_x = p->src_y = 0;
+        p->src_w = buf->width;
+        p->src_h = buf->height;
+        p->crtc_x = p->crtc_y = 0;
+        p->crtc_w = ep->bg.width;
+        p->crtc_h = ep->bg.height;
+    }
+
+    if (!eplay_kms_commit(ep))
+        return false;
+
     ep->show_overlay = true;
     return true;
 }
 
 void eplay_hide_overlay(struct eplay* ep)
 {
-    drmModeSetPlane(ep->drm_fd, ep->planes[1], ep->crtc, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    ep->ov_plane.fb_id = 0;
+    eplay_kms_commit(ep);
     ep->show_overlay = false;
 }
 
+void eplay_set_overlay_crop(struct eplay* ep, const Eina_Rectangle* r)
+{
+    Eina_Rectangle canvas;
+
+    ep->ov_cropped = false;
+
+    if (r)
+    {
+        eina_rectangle_coords_from(&canvas, 0, 0, ep->overlay[0].buf.width, ep->overlay[0].buf.height);
+        ep->ov_crop = *r;
+        ep->ov_cropped = eina_rectangle_intersection(&ep->ov_crop, &canvas);
+    }
+
+    if (ep->show_overlay)
+        eplay_show_overlay(ep);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define READAHEAD_MIN_BYTES (4 * 1024 * 1024)
+#define READAHEAD_MAX_BYTES (48 * 1024 * 1024)
+#define READAHEAD_DEFAULT_RATE (40000000 / 8) /* bytes/s, blu-ray peak */
+
+// protects the file and position handed to the prefetch thread
+static pthread_mutex_t s_ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_ra_cond = PTHREAD_COND_INITIALIZER;
+
+// demuxed data held in decodebin's multiqueue
+static guint64 queue_bytes(struct eplay* ep)
+{
+    guint64 bytes;
+
+    pthread_mutex_lock(&s_ra_lock);
+    bytes = ep->ra_byterate * EPLAY_READAHEAD_TIME;
+    pthread_mutex_unlock(&s_ra_lock);
+    return CLAMP(bytes, READAHEAD_MIN_BYTES, READAHEAD_MAX_BYTES);
+}
+
+static void underrun(GstElement* queue, gpointer data)
+{
+    struct eplay* ep = data;
+    __atomic_add_fetch(&ep->ra_underruns, 1, __ATOMIC_RELAXED);
+}
+
+void eplay_readahead_element(struct eplay* ep, GstElement* element)
+{
+    GstElementFactory* factory = gst_element_get_factory(element);
+    const gchar* name = factory ? GST_PLUGIN_FEATURE_NAME(factory) : NULL;
+    guint bytes = queue_bytes(ep);
+
+    if (!name)
+        return;
+
+    // decodebin applies its own limits to the queue once prerolled, unless told otherwise
+    if (strcmp(name, "decodebin2") == 0)
+    {
+        g_object_set(element, "use-buffering", TRUE, "max-size-bytes", bytes,
+                     "max-size-buffers", 0, "max-size-time", (guint64)0, NULL);
+    }
+    else if (strcmp(name, "multiqueue") == 0)
+    {
+        g_object_set(element, "max-size-bytes", bytes, "max-size-buffers", 0,
+                     "max-size-time", (guint64)0, NULL);
+        g_signal_connect(element, "underrun", G_CALLBACK(underrun), ep);
+    }
+}
+
+void eplay_readahead_start(struct eplay* ep, const char* file)
+{
+    const struct media_info* info = eplay_metadata_get(ep, file);
+    guint64 byterate = READAHEAD_DEFAULT_RATE;
+    unsigned int underruns = __atomic_exchange_n(&ep->ra_underruns, 0, __ATOMIC_RELAXED);
+
+    if (ep->ra_playing)
+        printf("readahead: %u underruns in the last playback\n", underruns);
+    ep->ra_playing = true;
+    ep->ra_total_underruns += underruns;
+    __atomic_store_n(&ep->ra_level, -1, __ATOMIC_RELAXED);
+
+    // the average bitrate of the whole file, peaks are covered by the time margin;
+    // size * GST_SECOND overflows 64 bits beyond 9 GB
+    if (info && info->duration > 0)
+        byterate = gst_util_uint64_scale(info->size, GST_SECOND, info->duration);
+
+    pthread_mutex_lock(&s_ra_lock);
+    ep->ra_byterate = byterate;
+    free(ep->ra_file);
+    ep->ra_file = strdup(file);
+    ep->ra_position = 0;
+    ep->ra_update = true;
+    pthread_cond_signal(&s_ra_cond);
+    pthread_mutex_unlock(&s_ra_lock);
+}
+
+void eplay_readahead_update(struct eplay* ep, gint64 position)
+{
+    pthread_mutex_lock(&s_ra_lock);
+    ep->ra_position = position;
+    ep->ra_update = true;
+    pthread_cond_signal(&s_ra_cond);
+    pthread_mutex_unlock(&s_ra_lock);
+}
+
+int eplay_readahead_level(struct eplay* ep)
+{
+    return __atomic_load_n(&ep->ra_level, __ATOMIC_RELAXED);
+}
+
+// keeps the page cache filled ahead of the demuxer, opening and advising may block on the disk
+static void* prefetch(void* data)
+{
+    struct eplay* ep = data;
+    int fd = -1;
+    off_t end = 0;
+
+    pthread_mutex_lock(&s_ra_lock);
+    while (!ep->ra_quit)
+    {
+        char* file;
+        off_t offset, window;
+
+        if (!ep->ra_update)
+        {
+            pthread_cond_wait(&s_ra_cond, &s_ra_lock);
+            continue;
+        }
+        ep->ra_update = false;
+
+        file = ep->ra_file;
+        ep->ra_file = NULL;
+        offset = gst_util_uint64_scale(MAX(ep->ra_position, 0), ep->ra_byterate, GST_SECOND);
+        window = 2 * ep->ra_byterate * EPLAY_READAHEAD_TIME;
+        pthread_mutex_unlock(&s_ra_lock);
+
+        if (file)
+        {
+            if (fd >= 0)
+                close(fd);
+            fd = open(file, O_RDONLY);
+            if (fd >= 0)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            end = 0;
+            free(file);
+        }
+
+        // after a seek the window starts over at the new position
+        if (offset + window < end || offset > end)
+            end = offset;
+        if (fd >= 0 && offset + window > end)
+        {
+            posix_fadvise(fd, end, offset + window - end, POSIX_FADV_WILLNEED);
+            end = offset + window;
+        }
+
+        pthread_mutex_lock(&s_ra_lock);
+    }
+    pthread_mutex_unlock(&s_ra_lock);
+
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+void eplay_readahead_report(struct eplay* ep)
+{
+    printf("readahead: %u kB/s, %u kB queued at most, %u underruns now, %u before\n",
+           (unsigned int)(ep->ra_byterate / 1024), (unsigned int)(queue_bytes(ep) / 1024),
+           __atomic_load_n(&ep->ra_underruns, __ATOMIC_RELAXED), ep->ra_total_underruns);
+}
+
+bool eplay_setup_readahead(struct eplay* ep)
+{
+    ep->ra_byterate = READAHEAD_DEFAULT_RATE;
+    ep->ra_level = -1;
+
+    if (pthread_create(&ep->ra_thread, NULL, prefetch, ep) != 0)
+    {
+        perror("readahead: pthread_create");
+        return false;
+    }
+    ep->ra_running = true;
+    return true;
+}
+
+void eplay_cleanup_readahead(struct eplay* ep)
+{
+    pthread_mutex_lock(&s_ra_lock);
+    ep->ra_quit = true;
+    pthread_cond_broadcast(&s_ra_cond);
+    pthread_mutex_unlock(&s_ra_lock);
+
+    if (ep->ra_running)
+        pthread_join(ep->ra_thread, NULL);
+    ep->ra_running = false;
+
+    free(ep->ra_file);
+    ep->ra_file = NULL;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <ctype.h>
+#include <locale.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NATURAL_WIDTH_MAX 20 /* digits a number is padded to at most, 2^64 has 20 */
+
+/* key of one name in the arena, at an offset until the arena stops growing */
+union sort_key
+{
+    const char* key;
+    size_t offset;
+};
+
+/* keys of all names back to back, each after the index of its name */
+struct key_arena
+{
+    char* data;
+    size_t used, size;
+};
+
+static const char* s_mode_names[] = { "natural", "collate", "bytes" };
+
+bool eplay_sort_mode_find(const char* name, enum eplay_sort_mode* mode)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(s_mode_names) / sizeof(*s_mode_names); ++i)
+    {
+        if (strcmp(name, s_mode_names[i]) == 0)
+        {
+            *mode = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* eplay_sort_mode_name(enum eplay_sort_mode mode)
+{
+    return s_mode_names[mode];
+}
+
+// strcoll() orders like strcmp() then, the keys are the names themselves
+static bool byte_collation(void)
+{
+    const char* locale = setlocale(LC_COLLATE, NULL);
+
+    return !locale || strcmp(locale, "C") == 0 || strcmp(locale, "POSIX") == 0;
+}
+
+static bool reserve(struct key_arena* a, size_t len)
+{
+    if (a->used + len > a->size)
+    {
+        size_t size = a->size ? a->size : 64 * 1024;
+        char* d;
+
+        while (a->used + len > size)
+            size *= 2;
+        d = realloc(a->data, size);
+        if (!d)
+            return false;
+        a->data = d;
+        a->size = size;
+    }
+    return true;
+}
+
+static size_t longest_number(const char* const* names, unsigned int count, size_t skip)
+{
+    size_t longest = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        const char* s = names[i] + skip;
+
+        while (*s)
+        {
+            size_t n = 0;
+
+            while (isdigit((unsigned char)s[n]))
+                n++;
+            if (n > longest)
+                longest = n;
+            s += n ? n : 1;
+        }
+    }
+    return MIN(longest, NATURAL_WIDTH_MAX);
+}
+
+// numbers padded with zeros to the same width, so "2" orders before "10" digit by digit
+static void natural_form(const char* s, size_t width, char* out, size_t len)
+{
+    size_t o = 0;
+
+    while (*s && o + width + 1 < len)
+    {
+        size_t n = 0;
+
+        while (isdigit((unsigned char)s[n]))
+            n++;
+        if (!n)
+        {
+            out[o++] = *s++;
+            continue;
+        }
+        if (n < width)
+        {
+            memset(out + o, '0', width - n);
+            o += width - n;
+        }
+        n = MIN(n, len - o - 1);
+        memcpy(out + o, s, n);
+        o += n;
+        s += n;
+    }
+    out[o] = '\0';
+}
+
+// appends the index and the key of s with its terminating zero, returns the offset of the key
+static bool add_key(struct key_arena* a, unsigned int index, const char* s, bool transform, size_t* offset)
+{
+    size_t len = transform ? strlen(s) * 4 + 1 : strlen(s) + 1;
+
+    // keys are typically 2-4 times the length of the name
+    for (;;)
+    {
+        size_t n;
+
+        if (!reserve(a, sizeof(index) + len))
+            return false;
+        *offset = a->used + sizeof(index);
+        if (!transform)
+        {
+            memcpy(a->data + *offset, s, len);
+            break;
+        }
+        n = strxfrm(a->data + *offset, s, a->size - *offset);
+        if (n < a->size - *offset)
+        {
+            len = n + 1;
+            break;
+        }
+        len = n + 1;
+    }
+    memcpy(a->data + a->used, &index, sizeof(index));
+    a->used = *offset + len;
+    return true;
+}
+
+static unsigned int key_index(const char* key)
+{
+    unsigned int index;
+
+    memcpy(&index, key - sizeof(index), sizeof(index));
+    return index;
+}
+
+static int compare_key(const void* a, const void* b)
+{
+    const char *x = ((const union sort_key*)a)->key, *y = ((const union sort_key*)b)->key;
+    int c = strcmp(x, y);
+
+    // equal keys keep the order they came in
+    return c ? c : (key_index(x) > key_index(y)) - (key_index(x) < key_index(y));
+}
+
+unsigned int* eplay_sort_order(const char* const* names, unsigned int count, size_t skip,
+                               enum eplay_sort_mode mode)
+{
+    struct key_arena arena = { NULL };
+    union sort_key* keys = malloc((count + 1) * sizeof(*keys));
+    unsigned int* order = malloc((count + 1) * sizeof(*order));
+    bool transform = mode != EPLAY_SORT_BYTES && !byte_collation();
+    size_t width = mode == EPLAY_SORT_NATURAL ? longest_number(names, count, skip) : 0;
+    unsigned int i;
+
+    if (!keys || !order)
+        goto fail;
+
+    // the keys are copied even where the names would do, sorting is faster when they are contiguous
+    for (i = 0; i < count; ++i)
+    {
+        const char* name = names[i] + skip;
+        char buf[PATH_MAX + NATURAL_WIDTH_MAX * 8];
+
+        if (width)
+        {
+            natural_form(name, width, buf, sizeof(buf));
+            name = buf;
+        }
+        if (!add_key(&arena, i, name, transform, &keys[i].offset))
+            goto fail;
+    }
+    for (i = 0; i < count; ++i)
+        keys[i].key = arena.data + keys[i].offset;
+
+    // strcmp() on the keys orders like strcoll() on the names, without decoding them every time
+    qsort(keys, count, sizeof(*keys), compare_key);
+    for (i = 0; i < count; ++i)
+        order[i] = key_index(keys[i].key);
+
+    free(keys);
+    free(arena.data);
+    return order;
+
+fail:
+    free(keys);
+    free(order);
+    free(arena.data);
+    return NULL;
+}
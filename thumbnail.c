@@ -0,0 +1,369 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PLAY_FLAG_VIDEO 0x1
+
+/* decoded or loaded picture, handed from the worker to the main loop */
+struct thumb_result
+{
+    struct eplay* ep;
+    const char* path;
+    uint32_t* pixels;
+    int width, height;
+    bool decoded; /* not from the cache file */
+};
+
+// protects the job list and the quit flag
+static pthread_mutex_t s_thumb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_thumb_cond = PTHREAD_COND_INITIALIZER;
+
+static void free_thumb(void* data)
+{
+    struct thumbnail* t = data;
+
+    eina_stringshare_del(t->path);
+    free(t->pixels);
+    free(t);
+}
+
+// prerolls the file, seeks to a key frame and lets playbin scale it down
+static uint32_t* decode(GstElement* bin, const char* path, int* width, int* height)
+{
+    GstFormat format = GST_FORMAT_TIME;
+    GstBuffer *frame = NULL, *thumb = NULL;
+    GstStructure* s;
+    GstCaps* caps;
+    gint64 duration;
+    uint32_t* pixels = NULL;
+    gchar* uri;
+    int vw = 0, vh = 0, w, h, y;
+
+    uri = gst_filename_to_uri(path, NULL);
+    if (!uri)
+        return NULL;
+    g_object_set(bin, "uri", uri, NULL);
+    g_free(uri);
+
+    gst_element_set_state(bin, GST_STATE_PAUSED);
+    if (gst_element_get_state(bin, NULL, NULL, EPLAY_MEDIA_TIMEOUT * GST_SECOND) != GST_STATE_CHANGE_SUCCESS)
+        goto out;
+
+    // the first frames are often black
+    if (gst_element_query_duration(bin, &format, &duration) && duration > 0 &&
+        gst_element_seek_simple(bin, GST_FORMAT_TIME, GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, duration / 10))
+        gst_element_get_state(bin, NULL, NULL, EPLAY_MEDIA_TIMEOUT * GST_SECOND);
+
+    g_object_get(bin, "frame", &frame, NULL);
+    if (!frame)
+        goto out;
+    s = GST_BUFFER_CAPS(frame) ? gst_caps_get_structure(GST_BUFFER_CAPS(frame), 0) : NULL;
+    if (s)
+    {
+        gst_structure_get_int(s, "width", &vw);
+        gst_structure_get_int(s, "height", &vh);
+    }
+    gst_buffer_unref(frame);
+    if (vw <= 0 || vh <= 0)
+        goto out;
+
+    w = EPLAY_THUMB_WIDTH;
+    h = MAX(2, (w * vh / vw) & ~1);
+
+    // xrgb in memory order b, g, r, x as evas expects it
+    caps = gst_caps_new_simple("video/x-raw-rgb",
+                               "bpp", G_TYPE_INT, 32,
+                               "depth", G_TYPE_INT, 24,
+                               "endianness", G_TYPE_INT, G_BIG_ENDIAN,
+                               "red_mask", G_TYPE_INT, 0x0000ff00,
+                               "green_mask", G_TYPE_INT, 0x00ff0000,
+                               "blue_mask", G_TYPE_INT, (gint)0xff000000,
+                               "width", G_TYPE_INT, w,
+                               "height", G_TYPE_INT, h,
+                               "pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+                               NULL);
+    g_signal_emit_by_name(bin, "convert-frame", caps, &thumb);
+    gst_caps_unref(caps);
+    if (!thumb)
+        goto out;
+
+    if (GST_BUFFER_SIZE(thumb) >= (guint)(w * h * 4) && (pixels = malloc(w * h * 4)))
+    {
+        memcpy(pixels, GST_BUFFER_DATA(thumb), w * h * 4);
+        for (y = 0; y < w * h; ++y)
+            pixels[y] |= 0xff000000;
+        *width = w;
+        *height = h;
+    }
+    gst_buffer_unref(thumb);
+
+out:
+    gst_element_set_state(bin, GST_STATE_NULL);
+    return pixels;
+}
+
+static struct thumb_result* make_thumb(struct eplay* ep, GstElement* bin, const char* path)
+{
+    struct thumb_result* r;
+    struct stat st;
+    char key[PATH_MAX + 40];
+    unsigned int w, h;
+    int alpha, compress, quality, lossy;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return NULL;
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->ep = ep;
+    r->path = eina_stringshare_ref(path);
+
+    // a changed file gets a new entry
+    snprintf(key, sizeof(key), "%s|%llx|%llx", path, (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtime);
+
+    if (ep->thumb_cache &&
+        (r->pixels = eet_data_image_read(ep->thumb_cache, key, &w, &h, &alpha, &compress, &quality, &lossy)))
+    {
+        r->width = w;
+        r->height = h;
+        return r;
+    }
+
+    r->decoded = true;
+    if (bin)
+        r->pixels = decode(bin, path, &r->width, &r->height);
+    if (r->pixels && ep->thumb_cache)
+        eet_data_image_write(ep->thumb_cache, key, r->pixels, r->width, r->height, 0, 0, 80, 1);
+    return r;
+}
+
+static void evict(struct eplay* ep, struct thumbnail* keep)
+{
+    while (ep->thumb_bytes > EPLAY_THUMB_BUDGET && ep->thumb_lru)
+    {
+        struct thumbnail* t = EINA_INLIST_CONTAINER_GET(ep->thumb_lru, struct thumbnail);
+        if (t == keep)
+            break;
+
+        ep->thumb_lru = eina_inlist_remove(ep->thumb_lru, EINA_INLIST_GET(t));
+        ep->thumb_bytes -= t->bytes;
+        ep->thumb_evicted++;
+        eina_hash_del_by_key(ep->thumbs, t->path);
+    }
+}
+
+// main loop
+static void finished(void* data)
+{
+    struct thumb_result* r = data;
+    struct eplay* ep = r->ep;
+    struct thumbnail* t;
+
+    // posted just before the worker was stopped
+    if (!ep->thumbs || eina_hash_find(ep->thumbs, r->path) || !(t = calloc(1, sizeof(*t))))
+    {
+        free(r->pixels);
+        eina_stringshare_del(r->path);
+        free(r);
+        return;
+    }
+
+    if (r->decoded)
+        ep->thumb_decoded++;
+    else
+        ep->thumb_loaded++;
+
+    t->path = r->path;
+    t->pixels = r->pixels;
+    t->width = r->width;
+    t->height = r->height;
+    t->bytes = sizeof(*t) + (t->pixels ? (size_t)t->width * t->height * 4 : 0);
+    free(r);
+
+    eina_hash_add(ep->thumbs, t->path, t);
+    ep->thumb_lru = eina_inlist_append(ep->thumb_lru, EINA_INLIST_GET(t));
+    ep->thumb_bytes += t->bytes;
+    evict(ep, t);
+
+    if (t->pixels)
+        eplay_thumbnail_ready(ep, t->path);
+}
+
+static void* worker(void* data)
+{
+    struct eplay* ep = data;
+    GstElement *bin, *sink;
+
+    eplay_lower_priority();
+
+    bin = gst_element_factory_make("playbin2", NULL);
+    if (bin)
+    {
+        // nothing is shown or heard, only the video stream gets decoded
+        sink = gst_element_factory_make("fakesink", NULL);
+        g_object_set(bin, "video-sink", sink, "flags", PLAY_FLAG_VIDEO, NULL);
+    }
+
+    pthread_mutex_lock(&s_thumb_lock);
+    while (!ep->thumb_quit)
+    {
+        const char* path;
+        struct thumb_result* r;
+
+        if (!ep->thumb_jobs)
+        {
+            pthread_cond_wait(&s_thumb_cond, &s_thumb_lock);
+            continue;
+        }
+
+        // the item realized last is most likely still on screen
+        path = eina_list_data_get(eina_list_last(ep->thumb_jobs));
+        ep->thumb_jobs = eina_list_remove_list(ep->thumb_jobs, eina_list_last(ep->thumb_jobs));
+        pthread_mutex_unlock(&s_thumb_lock);
+
+        r = make_thumb(ep, bin, path);
+        if (r)
+            ecore_main_loop_thread_safe_call_async(finished, r);
+        eina_stringshare_del(path);
+
+        pthread_mutex_lock(&s_thumb_lock);
+    }
+    pthread_mutex_unlock(&s_thumb_lock);
+
+    if (bin)
+        gst_object_unref(bin);
+    return NULL;
+}
+
+const struct thumbnail* eplay_thumbnail_get(struct eplay* ep, const char* path)
+{
+    struct thumbnail* t;
+
+    if (!ep->thumbs)
+        return NULL;
+
+    t = eina_hash_find(ep->thumbs, path);
+    if (t)
+    {
+        ep->thumb_hits++;
+        ep->thumb_lru = eina_inlist_demote(ep->thumb_lru, EINA_INLIST_GET(t));
+        return t;
+    }
+
+    // jobs are stringshares, found by pointer
+    path = eina_stringshare_add(path);
+    pthread_mutex_lock(&s_thumb_lock);
+    if (!eina_list_data_find(ep->thumb_jobs, path))
+    {
+        ep->thumb_jobs = eina_list_append(ep->thumb_jobs, path);
+        path = NULL;
+        pthread_cond_signal(&s_thumb_cond);
+    }
+    pthread_mutex_unlock(&s_thumb_lock);
+    eina_stringshare_del(path);
+    return NULL;
+}
+
+void eplay_thumbnail_cancel(struct eplay* ep, const char* path)
+{
+    Eina_List *l, *next;
+    const char* job;
+
+    // NULL drops them all
+    path = path ? eina_stringshare_add(path) : NULL;
+    pthread_mutex_lock(&s_thumb_lock);
+    EINA_LIST_FOREACH_SAFE(ep->thumb_jobs, l, next, job)
+    {
+        if (path && job != path)
+            continue;
+        ep->thumb_jobs = eina_list_remove_list(ep->thumb_jobs, l);
+        eina_stringshare_del(job);
+        ep->thumb_cancelled++;
+    }
+    pthread_mutex_unlock(&s_thumb_lock);
+    eina_stringshare_del(path);
+}
+
+void eplay_thumbnail_report(struct eplay* ep)
+{
+    printf("thumbnails: %u hits, %u decoded, %u from disk, %u cancelled, %u evicted, %zu kB in memory\n",
+           ep->thumb_hits, ep->thumb_decoded, ep->thumb_loaded, ep->thumb_cancelled, ep->thumb_evicted,
+           ep->thumb_bytes / 1024);
+}
+
+bool eplay_setup_thumbnails(struct eplay* ep)
+{
+    char path[PATH_MAX];
+
+    ep->thumbs = eina_hash_string_superfast_new(free_thumb);
+    if (!ep->thumbs)
+        return false;
+
+    if (eplay_cache_dir(path, sizeof(path), "thumbnails"))
+    {
+        strncat(path, "/thumbs.eet", sizeof(path) - strlen(path) - 1);
+        ep->thumb_cache = eet_open(path, EET_FILE_MODE_READ_WRITE);
+    }
+    if (!ep->thumb_cache)
+        fprintf(stderr, "thumbnails: no cache file\n");
+
+    if (pthread_create(&ep->thumb_worker, NULL, worker, ep) != 0)
+    {
+        perror("thumbnails: pthread_create");
+        return false;
+    }
+    ep->thumb_running = true;
+    return true;
+}
+
+void eplay_cleanup_thumbnails(struct eplay* ep)
+{
+    pthread_mutex_lock(&s_thumb_lock);
+    ep->thumb_quit = true;
+    pthread_cond_broadcast(&s_thumb_cond);
+    pthread_mutex_unlock(&s_thumb_lock);
+
+    if (ep->thumb_running)
+        pthread_join(ep->thumb_worker, NULL);
+    ep->thumb_running = false;
+
+    eplay_thumbnail_cancel(ep, NULL);
+
+    // written back only now, entries added this session are lost on a crash
+    if (ep->thumb_cache)
+        eet_close(ep->thumb_cache);
+    ep->thumb_cache = NULL;
+    if (ep->thumbs)
+        eina_hash_free(ep->thumbs);
+    ep->thumbs = NULL;
+    ep->thumb_lru = NULL;
+    ep->thumb_bytes = 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "eplay.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+uint64_t eplay_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void eplay_timing_push(struct frame_timing_ring* r, const struct frame_timing* t)
+{
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    r->frames[head & (EPLAY_TIMING_FRAMES - 1)] = *t;
+    // publish the entry only once it is complete
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// copies the newest frames, returns how many are valid
+static unsigned int
+snapshot(const struct frame_timing_ring* r, struct frame_timing* out)
+{
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int count = head < EPLAY_TIMING_FRAMES ? head : EPLAY_TIMING_FRAMES;
+    unsigned int first = head - count;
+    unsigned int i, now, skip;
+
+    for (i = 0; i < count; ++i)
+        out[i] = r->frames[(first + i) & (EPLAY_TIMING_FRAMES - 1)];
+
+    // drop whatever the producer overwrote while we were copying
+    now = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    skip = now - head;
+    if (skip >= count)
+        return 0;
+
+    for (i = 0; i + skip < count; ++i)
+        out[i] = out[i + skip];
+    return count - skip;
+}
+
+static int
+compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+print_summary(const char* name, uint32_t* v, unsigned int count)
+{
+    uint64_t sum = 0;
+    unsigned int i;
+
+    qsort(v, count, sizeof(*v), compare_u32);
+    for (i = 0; i < count; ++i)
+        sum += v[i];
+
+    printf("  %-12s min %8u  avg %8llu  p99 %8u\n", name, v[0],
+           (unsigned long long)(sum / count), v[(count * 99 - 1) / 100]);
+}
+
+void eplay_timing_report(struct eplay* ep)
+{
+    struct frame_timing frames[EPLAY_TIMING_FRAMES];
+    uint32_t v[EPLAY_TIMING_FRAMES];
+    unsigned int count = snapshot(&ep->timing, frames);
+    unsigned int i, missed = 0;
+
+    if (count == 0)
+    {
+        printf("osd: no frames recorded\n");
+        return;
+    }
+
+    printf("osd: last %u frames (us):\n", count);
+
+    for (i = 0; i < count; ++i)
+        v[i] = frames[i].render;
+    print_summary("render", v, count);
+
+    for (i = 0; i < count; ++i)
+        v[i] = frames[i].commit;
+    print_summary("to commit", v, count);
+
+    for (i = 0; i < count; ++i)
+        v[i] = frames[i].scanout;
+    print_summary("to scanout", v, count);
+
+    for (i = 0; i < count; ++i)
+        v[i] = frames[i].dirty_pixels;
+    print_summary("dirty pixels", v, count);
+
+    for (i = 0; i < count; ++i)
+        missed += frames[i].missed;
+    printf("  %u missed vblanks, %u frames total\n", missed, ep->timing.head);
+}
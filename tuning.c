@@ -0,0 +1,144 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "eplay.h"
+#include <stdio.h>
+#include <string.h>
+
+/* property applied to every element made by a factory */
+struct element_tuning
+{
+    const char* factory;
+    const char* property;
+    const char* value; /* parsed according to the property type */
+};
+
+static const struct element_tuning s_profile[] = {
+    // dolby and dts tracks are downmixed to stereo with dynamic range compression
+    { "a52dec", "mode", "2" },
+    { "a52dec", "drc", "true" },
+    { "dtsdec", "drc", "true" },
+    // the a9 has two cores
+    { "ffdec_h264", "max-threads", "2" },
+    { "ffdec_mpeg2video", "max-threads", "2" },
+    { "ffdec_mpeg4", "max-threads", "2" },
+    // enough slack in the sound card for a busy main loop
+    { "alsasink", "buffer-time", "200000" },
+    { "alsasink", "latency-time", "10000" },
+};
+
+// streaming threads: called for every element as a bin adds it, before it leaves NULL
+void eplay_tune_element(struct tune_counters* counters, GstElement* element)
+{
+    GstElementFactory* factory = gst_element_get_factory(element);
+    const gchar* name = factory ? GST_PLUGIN_FEATURE_NAME(factory) : NULL;
+    uint64_t start = eplay_time_us();
+    unsigned int i, props = 0;
+
+    if (!name)
+        return;
+
+    for (i = 0; i < sizeof(s_profile) / sizeof(s_profile[0]); ++i)
+    {
+        const struct element_tuning* t = &s_profile[i];
+
+        if (strcmp(t->factory, name) != 0)
+            continue;
+        // older plugins lack some properties
+        if (!g_object_class_find_property(G_OBJECT_GET_CLASS(element), t->property))
+            continue;
+        gst_util_set_object_arg(G_OBJECT(element), t->property, t->value);
+        props++;
+    }
+
+    __atomic_add_fetch(&counters->elements, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters->props, props, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counters->time, eplay_time_us() - start, __ATOMIC_RELAXED);
+}
+
+static bool in_profile(const char* name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(s_profile) / sizeof(s_profile[0]); ++i)
+        if (strcmp(name, s_profile[i].factory) == 0)
+            return true;
+    return false;
+}
+
+// what the scan after preroll used to cost, the same walk without setting anything
+static uint64_t scan_time(GstBin* bin)
+{
+    GstIterator* iter = gst_bin_iterate_recurse(bin);
+    uint64_t start = eplay_time_us();
+    unsigned int matches = 0;
+    gpointer elem;
+
+    while (GST_ITERATOR_OK == gst_iterator_next(iter, &elem))
+    {
+        GstElementFactory* factory = gst_element_get_factory(GST_ELEMENT(elem));
+        if (factory)
+        {
+            gchar* name = NULL;
+            g_object_get(factory, "name", &name, NULL);
+            if (name && in_profile(name))
+                matches++;
+            g_free(name);
+        }
+        g_object_unref(elem);
+    }
+    gst_iterator_free(iter);
+
+    printf("tuning: scan after preroll visits %u profiled elements\n", matches);
+    return eplay_time_us() - start;
+}
+
+// main loop: a file has been opened, its elements are all in place
+void eplay_tuning_opened(struct eplay* ep, GstElement* playbin, struct tune_counters* counters)
+{
+    uint64_t time = __atomic_exchange_n(&counters->time, 0, __ATOMIC_RELAXED);
+    unsigned int elements = __atomic_exchange_n(&counters->elements, 0, __ATOMIC_RELAXED);
+    unsigned int props = __atomic_exchange_n(&counters->props, 0, __ATOMIC_RELAXED);
+    uint64_t scan;
+
+    // measured once, the pipelines look alike
+    if (!ep->tune_scan_time)
+        ep->tune_scan_time = scan_time(GST_BIN(playbin));
+    scan = ep->tune_scan_time;
+
+    ep->tune_opens++;
+    ep->tune_total += time;
+    printf("tuning: %u properties on %u elements in %.1f ms, the scan after preroll took %.1f ms\n",
+           props, elements, time / 1000.0, scan / 1000.0);
+}
+
+void eplay_tuning_report(struct eplay* ep)
+{
+    if (!ep->tune_opens)
+        return;
+    printf("tuning: %.1f ms per open while plugging, %.1f ms saved per open\n",
+           ep->tune_total / 1000.0 / ep->tune_opens,
+           ((double)ep->tune_scan_time * ep->tune_opens - ep->tune_total) / 1000.0 / ep->tune_opens);
+}
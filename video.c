@@ -0,0 +1,521 @@
+/*
+ * Copyright 2013 Mathias Fiedler. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   1. Redistributions of source code must retain the above copyright notice,
+ *      this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+ * FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "eplay.h"
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const struct
+{
+    const char* name;
+    uint32_t fourcc; /* drm fourcc */
+} s_video_formats[] = {
+    { "I420", DRM_FORMAT_YUV420 },
+    { "NV12", DRM_FORMAT_NV12 },
+    { "YUY2", DRM_FORMAT_YUYV },
+    { "UYVY", DRM_FORMAT_UYVY },
+};
+
+#define NUM_VIDEO_FORMATS (sizeof(s_video_formats) / sizeof(s_video_formats[0]))
+
+// the pool is touched from the decoder and sink threads and from buffer finalizers
+static pthread_mutex_t s_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* one per sink, a pipeline prerolling the next file keeps out of the pool */
+struct video_sink
+{
+    struct eplay* ep;
+    int background; /* atomic, cleared once the pipeline is on screen */
+};
+
+static uint32_t
+drm_fourcc(uint32_t gst_fourcc)
+{
+    unsigned int i;
+    for (i = 0; i < NUM_VIDEO_FORMATS; ++i)
+        if (gst_fourcc == GST_STR_FOURCC(s_video_formats[i].name))
+            return s_video_formats[i].fourcc;
+    return 0;
+}
+
+static void
+make_layout(struct video_layout* l, uint32_t fourcc, int w, int h, int stride, int chroma_stride)
+{
+    int h2 = GST_ROUND_UP_2(h);
+    int last;
+
+    memset(l, 0, sizeof(*l));
+    l->fourcc = fourcc;
+    l->stride[0] = stride;
+    l->rows[0] = h;
+
+    switch (fourcc)
+    {
+    case DRM_FORMAT_YUV420:
+        l->planes = 3;
+        l->row_bytes[0] = w;
+        l->stride[1] = l->stride[2] = chroma_stride;
+        l->row_bytes[1] = l->row_bytes[2] = (w + 1) / 2;
+        l->rows[1] = l->rows[2] = h2 / 2;
+        l->offset[1] = (size_t)stride * h2;
+        l->offset[2] = l->offset[1] + (size_t)chroma_stride * h2 / 2;
+        break;
+    case DRM_FORMAT_NV12:
+        l->planes = 2;
+        l->row_bytes[0] = w;
+        l->stride[1] = chroma_stride;
+        l->row_bytes[1] = GST_ROUND_UP_2(w);
+        l->rows[1] = h2 / 2;
+        l->offset[1] = (size_t)stride * h2;
+        break;
+    default: // packed 4:2:2
+        l->planes = 1;
+        l->row_bytes[0] = GST_ROUND_UP_2(w) * 2;
+        break;
+    }
+
+    last = l->planes - 1;
+    l->size = l->offset[last] + (size_t)l->stride[last] * l->rows[last];
+}
+
+// strides and offsets GStreamer 0.10 assumes for raw video
+static void
+gst_layout(struct video_layout* l, uint32_t fourcc, int w, int h)
+{
+    if (fourcc == DRM_FORMAT_YUYV || fourcc == DRM_FORMAT_UYVY)
+        make_layout(l, fourcc, w, h, GST_ROUND_UP_4(w * 2), 0);
+    else if (fourcc == DRM_FORMAT_NV12)
+        make_layout(l, fourcc, w, h, GST_ROUND_UP_4(w), GST_ROUND_UP_4(w));
+    else
+        make_layout(l, fourcc, w, h, GST_ROUND_UP_4(w), GST_ROUND_UP_8(w) / 2);
+}
+
+static void
+destroy_pool(struct eplay* ep)
+{
+    int i;
+
+    for (i = 0; i < EPLAY_VIDEO_BUFFERS; ++i)
+    {
+        eplay_destroy_drm_buffer(ep, &ep->video_slots[i].buf);
+        ep->video_slots[i].busy = false;
+    }
+
+    if (ep->video_caps)
+        gst_caps_unref(ep->video_caps);
+    ep->video_caps = NULL;
+}
+
+static bool
+create_slot(struct eplay* ep, struct drm_buffer* buf, int w, int h)
+{
+    const struct video_layout* l = &ep->video_dst;
+    uint32_t fourcc = ep->video_src.fourcc;
+    uint32_t handles[4] = { 0 };
+    uint32_t pitches[4] = { 0 };
+    uint32_t offsets[4] = { 0 };
+    bool packed = fourcc == DRM_FORMAT_YUYV || fourcc == DRM_FORMAT_UYVY;
+    int i;
+
+    if (packed ? !eplay_alloc_drm_buffer(ep, buf, GST_ROUND_UP_2(w), h, 2) :
+                 !eplay_alloc_drm_buffer(ep, buf, GST_ROUND_UP_8(w), GST_ROUND_UP_2(h) * 3 / 2, 1))
+        return false;
+
+    // all slots share the layout of the first one
+    if (buf == &ep->video_slots[0].buf)
+    {
+        if (packed)
+            make_layout(&ep->video_dst, fourcc, w, h, buf->pitch, 0);
+        else
+            make_layout(&ep->video_dst, fourcc, w, h, buf->pitch,
+                        fourcc == DRM_FORMAT_NV12 ? buf->pitch : buf->pitch / 2);
+    }
+    else if (buf->pitch != l->stride[0])
+    {
+        fprintf(stderr, "video: inconsistent buffer pitch %i\n", buf->pitch);
+        return false;
+    }
+
+    for (i = 0; i < l->planes; ++i)
+    {
+        handles[i] = buf->handle;
+        pitches[i] = l->stride[i];
+        offsets[i] = l->offset[i];
+    }
+
+    buf->width = w;
+    buf->height = h;
+
+    if (drmModeAddFB2(ep->drm_fd, w, h, fourcc, handles, pitches, offsets, &buf->fb_id, 0))
+    {
+        fprintf(stderr, "drmModeAddFB2 failed: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static void
+fit_to_screen(struct eplay* ep, int w, int h)
+{
+    struct kms_plane* p = &ep->video_plane;
+    int cw = ep->bg.width, ch = ep->bg.height;
+
+    if ((int64_t)w * ch > (int64_t)h * cw)
+        ch = (int64_t)h * cw / w;
+    else
+        cw = (int64_t)w * ch / h;
+
+    p->src_x = p->src_y = 0;
+    p->src_w = w;
+    p->src_h = h;
+    p->crtc_x = (ep->bg.width - cw) / 2;
+    p->crtc_y = (ep->bg.height - ch) / 2;
+    p->crtc_w = cw;
+    p->crtc_h = ch;
+}
+
+// call with the pool lock held, the pool can only change while no frame is out
+static bool
+configure_pool(struct eplay* ep, GstCaps* caps)
+{
+    GstStructure* s;
+    uint32_t fourcc = 0;
+    int i, w = 0, h = 0;
+
+    if (ep->video_caps && gst_caps_is_equal(caps, ep->video_caps))
+        return true;
+
+    for (i = 0; i < EPLAY_VIDEO_BUFFERS; ++i)
+        if (ep->video_slots[i].busy)
+            return false;
+
+    destroy_pool(ep);
+
+    s = gst_caps_get_structure(caps, 0);
+    if (!gst_structure_get_int(s, "width", &w) || !gst_structure_get_int(s, "height", &h) ||
+        !gst_structure_get_fourcc(s, "format", &fourcc) || !(fourcc = drm_fourcc(fourcc)) ||
+        w <= 0 || h <= 0)
+    {
+        fprintf(stderr, "video: unsupported caps\n");
+        return false;
+    }
+
+    gst_layout(&ep->video_src, fourcc, w, h);
+
+    for (i = 0; i < EPLAY_VIDEO_BUFFERS; ++i)
+    {
+        if (!create_slot(ep, &ep->video_slots[i].buf, w, h))
+        {
+            destroy_pool(ep);
+            return false;
+        }
+    }
+
+    // decoders assume the default strides, they can only write into matching buffers
+    ep->video_direct = memcmp(&ep->video_src, &ep->video_dst, sizeof(ep->video_src)) == 0;
+    ep->video_caps = gst_caps_ref(caps);
+    fit_to_screen(ep, w, h);
+
+    printf("video: %ix%i %.4s, %i buffers, %s\n", w, h, (const char*)&fourcc,
+           EPLAY_VIDEO_BUFFERS, ep->video_direct ? "zero-copy" : "copying");
+    return true;
+}
+
+static struct video_slot*
+take_slot(struct eplay* ep)
+{
+    int i;
+    for (i = 0; i < EPLAY_VIDEO_BUFFERS; ++i)
+    {
+        struct video_slot* slot = &ep->video_slots[i];
+        if (!slot->busy && slot->buf.fb_id)
+        {
+            slot->busy = true;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static struct video_slot*
+find_slot(struct eplay* ep, const void* data)
+{
+    int i;
+    for (i = 0; i < EPLAY_VIDEO_BUFFERS; ++i)
+        if (ep->video_slots[i].buf.data && ep->video_slots[i].buf.data == data)
+            return &ep->video_slots[i];
+    return NULL;
+}
+
+static void
+release_slot(gpointer data)
+{
+    struct video_slot* slot = data;
+
+    pthread_mutex_lock(&s_pool_lock);
+    slot->busy = false;
+    pthread_mutex_unlock(&s_pool_lock);
+}
+
+// the slot goes back to the pool when the last reference to the buffer is dropped
+static GstBuffer*
+wrap_slot(struct eplay* ep, struct video_slot* slot, GstCaps* caps, guint64 offset)
+{
+    GstBuffer* b = gst_buffer_new();
+
+    GST_BUFFER_DATA(b) = slot->buf.data;
+    GST_BUFFER_SIZE(b) = ep->video_src.size;
+    GST_BUFFER_OFFSET(b) = offset;
+    GST_BUFFER_MALLOCDATA(b) = (guint8*)slot;
+    GST_BUFFER_FREE_FUNC(b) = release_slot;
+    gst_buffer_set_caps(b, caps);
+    return b;
+}
+
+static GstFlowReturn
+buffer_alloc(GstPad* pad, guint64 offset, guint size, GstCaps* caps, GstBuffer** buf)
+{
+    struct video_sink* vs = gst_pad_get_element_private(pad);
+    struct eplay* ep = vs->ep;
+    struct video_slot* slot = NULL;
+
+    // the slots are scanout buffers, the frame on screen may be in any of them
+    if (__atomic_load_n(&vs->background, __ATOMIC_ACQUIRE))
+    {
+        *buf = NULL;
+        return GST_FLOW_OK;
+    }
+
+    pthread_mutex_lock(&s_pool_lock);
+    if (configure_pool(ep, caps) && ep->video_direct && size <= ep->video_src.size)
+        slot = take_slot(ep);
+    pthread_mutex_unlock(&s_pool_lock);
+
+    // without a buffer upstream falls back to system memory and the frame is copied
+    *buf = slot ? wrap_slot(ep, slot, caps, offset) : NULL;
+    __atomic_add_fetch(slot ? &ep->video_pool_hits : &ep->video_pool_misses, 1, __ATOMIC_RELAXED);
+    return GST_FLOW_OK;
+}
+
+static void
+copy_frame(const struct video_layout* dl, uint8_t* dst, const struct video_layout* sl, const uint8_t* src)
+{
+    int i, y;
+
+    for (i = 0; i < sl->planes; ++i)
+    {
+        const uint8_t* s = src + sl->offset[i];
+        uint8_t* d = dst + dl->offset[i];
+
+        for (y = 0; y < sl->rows[i]; ++y, s += sl->stride[i], d += dl->stride[i])
+            memcpy(d, s, sl->row_bytes[i]);
+    }
+}
+
+static void
+set_video_plane(struct eplay* ep, uint32_t fb_id)
+{
+    const struct kms_plane* p = &ep->video_plane;
+    int ret;
+
+    if (fb_id)
+        ret = drmModeSetPlane(ep->drm_fd, p->id, ep->crtc, fb_id, 0,
+                    p->crtc_x, p->crtc_y, p->crtc_w, p->crtc_h,
+                    p->src_x << 16, p->src_y << 16, p->src_w << 16, p->src_h << 16);
+    else
+        ret = drmModeSetPlane(ep->drm_fd, p->id, ep->crtc, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+    if (ret)
+        fprintf(stderr, "drmModeSetPlane failed: %s\n", strerror(errno));
+}
+
+// takes over the reference to b
+static void
+show_frame(struct eplay* ep, struct video_slot* slot, GstBuffer* b)
+{
+    set_video_plane(ep, slot->buf.fb_id);
+
+    // the previous frame is off the screen once the new one is set
+    if (ep->video_shown)
+        gst_buffer_unref(ep->video_shown);
+    ep->video_shown = b;
+}
+
+static void
+release_shown(struct eplay* ep)
+{
+    if (ep->video_shown)
+    {
+        set_video_plane(ep, 0);
+        gst_buffer_unref(ep->video_shown);
+        ep->video_shown = NULL;
+    }
+}
+
+static void
+handoff(GstElement* sink, GstBuffer* b, GstPad* pad, gpointer data)
+{
+    struct video_sink* vs = data;
+    struct eplay* ep = vs->ep;
+    GstCaps* caps = GST_BUFFER_CAPS(b);
+    struct video_slot* slot;
+    bool changed;
+
+    if (__atomic_load_n(&vs->background, __ATOMIC_ACQUIRE))
+        return;
+
+    // configure_pool may replace the caps from a decoder thread at any time
+    pthread_mutex_lock(&s_pool_lock);
+    slot = find_slot(ep, GST_BUFFER_DATA(b));
+    changed = caps && ep->video_caps && !gst_caps_is_equal(caps, ep->video_caps);
+    pthread_mutex_unlock(&s_pool_lock);
+
+    if (slot)
+    {
+        show_frame(ep, slot, gst_buffer_ref(b));
+        __atomic_add_fetch(&ep->video_zero_copy, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (!caps)
+        return;
+
+    // new caps, let go of the old frame so the pool can be rebuilt,
+    // outside the lock as the last unref gives its slot back
+    if (changed)
+        release_shown(ep);
+
+    pthread_mutex_lock(&s_pool_lock);
+    if (configure_pool(ep, caps) && GST_BUFFER_SIZE(b) >= ep->video_src.size)
+        slot = take_slot(ep);
+    pthread_mutex_unlock(&s_pool_lock);
+
+    if (!slot)
+    {
+        fprintf(stderr, "video: no buffer for frame, dropping it\n");
+        return;
+    }
+
+    copy_frame(&ep->video_dst, slot->buf.data, &ep->video_src, GST_BUFFER_DATA(b));
+    __atomic_add_fetch(&ep->video_copies, 1, __ATOMIC_RELAXED);
+
+    show_frame(ep, slot, wrap_slot(ep, slot, caps, GST_BUFFER_OFFSET(b)));
+}
+
+GstElement* eplay_create_video_sink(struct eplay* ep, bool background)
+{
+    struct video_sink* vs;
+    GstElement *bin, *filter, *sink;
+    GstPad *target, *pad;
+    GstCaps* caps;
+    char formats[64] = "";
+    char desc[128];
+    unsigned int i;
+
+    for (i = 0; i < NUM_VIDEO_FORMATS; ++i)
+    {
+        if (eplay_plane_supports_format(ep->drm_fd, ep->planes[0], s_video_formats[i].fourcc))
+        {
+            if (formats[0])
+                strcat(formats, ", ");
+            strcat(formats, s_video_formats[i].name);
+        }
+    }
+
+    if (!formats[0])
+    {
+        printf("video: plane %u takes no YUV format\n", ep->planes[0]);
+        return NULL;
+    }
+
+    filter = gst_element_factory_make("capsfilter", NULL);
+    sink = gst_element_factory_make("fakesink", NULL);
+    if (!filter || !sink)
+    {
+        printf("'capsfilter' or 'fakesink' gstreamer plugin missing\n");
+        return NULL;
+    }
+
+    // only what the plane scans out, playbin plugs a converter for the rest
+    snprintf(desc, sizeof(desc), "video/x-raw-yuv, format=(fourcc){ %s }", formats);
+    caps = gst_caps_from_string(desc);
+    g_object_set(filter, "caps", caps, NULL);
+    gst_caps_unref(caps);
+
+    vs = malloc(sizeof(*vs));
+    vs->ep = ep;
+    vs->background = background;
+
+    g_object_set(sink, "sync", TRUE, "qos", TRUE, "signal-handoffs", TRUE, "enable-last-buffer", FALSE, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(handoff), vs);
+
+    bin = gst_bin_new("eplay-video");
+    g_object_set_data_full(G_OBJECT(bin), "eplay-video", vs, free);
+    gst_bin_add_many(GST_BIN(bin), filter, sink, NULL);
+    gst_element_link(filter, sink);
+
+    // decoders allocate through the sink pad, that is where they get our buffers
+    target = gst_element_get_static_pad(filter, "sink");
+    pad = gst_ghost_pad_new("sink", target);
+    gst_object_unref(target);
+    gst_pad_set_element_private(pad, vs);
+    gst_pad_set_bufferalloc_function(pad, buffer_alloc);
+    gst_element_add_pad(bin, pad);
+
+    ep->video_plane.id = ep->planes[0];
+    printf("video: scanning out %s on plane %u\n", formats, ep->planes[0]);
+    return bin;
+}
+
+// frames decoded until now are in system memory and get copied, later ones go into the pool
+void eplay_video_sink_show(GstElement* sink)
+{
+    struct video_sink* vs = g_object_get_data(G_OBJECT(sink), "eplay-video");
+
+    if (vs)
+        __atomic_store_n(&vs->background, 0, __ATOMIC_RELEASE);
+}
+
+void eplay_cleanup_video(struct eplay* ep)
+{
+    release_shown(ep);
+
+    pthread_mutex_lock(&s_pool_lock);
+    destroy_pool(ep);
+    pthread_mutex_unlock(&s_pool_lock);
+}
+
+void eplay_video_report(struct eplay* ep)
+{
+    printf("video: %u frames zero-copy, %u copied, pool %u hits, %u misses\n",
+           ep->video_zero_copy, ep->video_copies, ep->video_pool_hits, ep->video_pool_misses);
+}